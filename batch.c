@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "batch.h"
+#include "parallel.h"
+#include "sectioncache.h"
+#include "composition.h"
+#include "voicebank.h"
+#include "wavetable.h"
+#include "fixedpoint.h"
+#include "trace.h"
+
+/* How long an idle worker waits before looking for work again. */
+#define IDLE_SLEEP_NS 100000
+
+/* A job's composition while it is in flight. */
+typedef struct _batch_file {
+    const batch_job* job;
+    composition comp;
+    int32_t num_voices;
+    entry_job* entries;
+    section_cache repeats; /* only its hits and misses are used */
+    int32_t* out;
+    uint64_t length;
+    int32_t remaining; /* entries still to render, counted down atomically */
+} batch_file;
+
+typedef struct _batch_task {
+    batch_file* file;
+    int32_t entry; /* play order entry to render, or -1 to load the file */
+} batch_task;
+
+/* The owner pushes and pops at tail, thieves take from head. A lock per
+   deque is plenty: tasks are whole play order entries, so they're taken
+   far less often than they take to run. */
+typedef struct _task_deque {
+    pthread_mutex_t lock;
+    batch_task* tasks;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+} task_deque;
+
+struct _batch_pool;
+
+typedef struct _batch_worker {
+    struct _batch_pool* pool;
+    int index;
+    task_deque deque;
+    output_state* os; /* remade whenever a file needs a different size */
+    uint32_t random; /* for picking whom to steal from */
+    batch_stats stats;
+    pthread_t thread;
+} batch_worker;
+
+typedef struct _batch_pool {
+    const batch_options* options;
+    batch_worker* workers;
+    int num_workers;
+    int64_t pending; /* tasks queued or running, counted atomically */
+} batch_pool;
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+static void push_task(task_deque* deque, batch_file* file, int32_t entry) {
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail == deque->capacity) {
+        if(deque->head > 0) {
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(*deque->tasks));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            deque->capacity = deque->capacity > 0 ? deque->capacity * 2 : 64;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(*deque->tasks));
+        }
+    }
+    deque->tasks[deque->tail].file = file;
+    deque->tasks[deque->tail].entry = entry;
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int pop_task(task_deque* deque, batch_task* task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail > deque->head) {
+        *task = deque->tasks[--deque->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int steal_from(task_deque* deque, batch_task* task) {
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail > deque->head) {
+        *task = deque->tasks[deque->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int steal_task(batch_worker* worker, batch_task* task) {
+    batch_pool* pool = worker->pool;
+    int start;
+
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    start = (int)(worker->random % (uint32_t)pool->num_workers);
+
+    for(int i = 0; i < pool->num_workers; ++i) {
+        int victim = (start + i) % pool->num_workers;
+        if(victim != worker->index && steal_from(&pool->workers[victim].deque, task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static output_state* worker_output_state(batch_worker* worker, int32_t num_voices) {
+    if(worker->os == NULL || worker->os->num_oscillators != num_voices) {
+        if(worker->os != NULL) {
+            free_output_state(worker->os);
+        }
+        worker->os = create_output_state(num_voices);
+        worker->os->engine = worker->pool->options->engine;
+        worker->os->interpolate = worker->pool->options->interpolate;
+    }
+    return worker->os;
+}
+
+static void release_file(batch_file* file) {
+    free_entry_jobs(&file->comp, file->entries);
+    file->entries = NULL;
+    free(file->out);
+    file->out = NULL;
+    free_composition(&file->comp);
+}
+
+/* Called by whichever worker rendered the file's last entry. */
+static void finish_file(batch_worker* worker, batch_file* file) {
+    const batch_options* options = worker->pool->options;
+    output_sink* sink;
+    int ret = -1;
+
+    copy_repeated_entries(&file->comp, file->entries, file->out);
+
+    sink = open_sink(options->discard ? NULL : file->job->output, options->container,
+                     options->format, 1, options->use_mmap, file->length);
+    if(sink != NULL) {
+        ret = sink_write(sink, file->out, file->length);
+        if(close_sink(sink) != 0) {
+            ret = -1;
+        }
+    }
+
+    if(ret == 0) {
+        worker->stats.files_rendered++;
+        worker->stats.samples += file->length;
+    } else {
+        fprintf(stderr, "%s: couldn't write %s.\n", file->job->input, file->job->output);
+        worker->stats.files_failed++;
+    }
+    worker->stats.repeats_reused += file->repeats.hits;
+    release_file(file);
+}
+
+/* Loads the file and queues its entries on this worker's own deque. */
+static void load_file(batch_worker* worker, batch_file* file) {
+    batch_pool* pool = worker->pool;
+    output_state* os;
+
+    if(load_composition(file->job->input, &file->comp) != 0) {
+        worker->stats.files_failed++;
+        return;
+    }
+
+    file->length = composition_length(&file->comp);
+    file->out = malloc(file->length * sizeof(*file->out) + 1);
+    if(file->out == NULL) {
+        fprintf(stderr, "%s: couldn't allocate %llu samples to render into.\n",
+                file->job->input, (unsigned long long)file->length);
+        free_composition(&file->comp);
+        worker->stats.files_failed++;
+        return;
+    }
+
+    /* One oscillator for every instrument of the busiest section. */
+    file->num_voices = max_section_instruments(&file->comp);
+    if(file->num_voices < 1) {
+        file->num_voices = 1;
+    }
+    os = worker_output_state(worker, file->num_voices);
+    file->entries = plan_entry_jobs(&file->comp, os,
+                                    pool->options->reuse_repeats ? &file->repeats : NULL);
+
+    if(file->comp.num_play_order == 0) {
+        finish_file(worker, file);
+        return;
+    }
+
+    /* This task is still pending, so the count can't reach zero while the
+       entries are being pushed. Pushed last to first, so the owner starts
+       at the beginning and thieves take from the end. */
+    file->remaining = file->comp.num_play_order;
+    __atomic_add_fetch(&pool->pending, file->comp.num_play_order, __ATOMIC_ACQ_REL);
+    for(int32_t i = file->comp.num_play_order - 1; i >= 0; --i) {
+        push_task(&worker->deque, file, i);
+    }
+}
+
+static void render_file_entry(batch_worker* worker, batch_file* file, int32_t entry) {
+    if(file->entries[entry].copy_of < 0) {
+        render_entry_job(worker_output_state(worker, file->num_voices), &file->comp,
+                         file->entries, entry, file->out);
+    } else if(TRACE_ON()) {
+        trace_play_order_entry(worker_output_state(worker, file->num_voices), &file->comp,
+                               entry);
+    }
+    /* The last one out sees every other worker's samples and writes the
+       file. */
+    if(__atomic_sub_fetch(&file->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        finish_file(worker, file);
+    }
+}
+
+static void* batch_worker_main(void* arg) {
+    batch_worker* worker = arg;
+    batch_pool* pool = worker->pool;
+
+    for(;;) {
+        batch_task task;
+
+        if(!pop_task(&worker->deque, &task)) {
+            if(steal_task(worker, &task)) {
+                worker->stats.tasks_stolen++;
+            } else if(__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0) {
+                break;
+            } else {
+                sleep_ns(IDLE_SLEEP_NS);
+                continue;
+            }
+        }
+
+        if(task.entry < 0) {
+            load_file(worker, task.file);
+        } else {
+            render_file_entry(worker, task.file, task.entry);
+        }
+        worker->stats.tasks++;
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+int render_batch(const batch_list* list, const batch_options* options, batch_stats* stats) {
+    batch_pool pool;
+    batch_file* files = calloc(sizeof(batch_file), list->num_jobs + 1);
+    int num_threads = options->num_threads;
+    int started = 1;
+
+    memset(stats, 0, sizeof(*stats));
+    if(num_threads <= 0) {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(num_threads < 1) {
+        num_threads = 1;
+    }
+
+    /* The one-time table setup and kernel choice are done here, so they
+       never run on two workers at once. */
+    init_wavetables();
+    init_fixed_tables();
+    current_voice_kernel();
+
+    pool.options = options;
+    pool.num_workers = num_threads;
+    pool.pending = list->num_jobs;
+    pool.workers = calloc(sizeof(batch_worker), num_threads);
+    for(int i = 0; i < num_threads; ++i) {
+        pool.workers[i].pool = &pool;
+        pool.workers[i].index = i;
+        pool.workers[i].random = 2463534242u + (uint32_t)i;
+        pthread_mutex_init(&pool.workers[i].deque.lock, NULL);
+    }
+
+    /* Files are dealt out round robin, first ones on top. */
+    for(int32_t i = list->num_jobs - 1; i >= 0; --i) {
+        files[i].job = list->jobs + i;
+        push_task(&pool.workers[i % num_threads].deque, files + i, -1);
+    }
+
+    /* The calling thread is worker 0, so the batch finishes even if no
+       other thread can be started. */
+    for(; started < num_threads; ++started) {
+        if(pthread_create(&pool.workers[started].thread, NULL, batch_worker_main,
+                          pool.workers + started) != 0) {
+            fprintf(stderr, "Couldn't start batch thread %d, carrying on with %d.\n",
+                    started, started);
+            break;
+        }
+    }
+    batch_worker_main(pool.workers);
+    for(int i = 1; i < started; ++i) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    /* Workers that never started left their tasks behind, so worker 0 will
+       have stolen them all. */
+    for(int i = 0; i < num_threads; ++i) {
+        batch_worker* worker = pool.workers + i;
+
+        stats->files_rendered += worker->stats.files_rendered;
+        stats->files_failed += worker->stats.files_failed;
+        stats->samples += worker->stats.samples;
+        stats->tasks += worker->stats.tasks;
+        stats->tasks_stolen += worker->stats.tasks_stolen;
+        stats->repeats_reused += worker->stats.repeats_reused;
+
+        if(worker->os != NULL) {
+            free_output_state(worker->os);
+        }
+        free(worker->deque.tasks);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+    stats->num_threads = started;
+
+    free(pool.workers);
+    free(files);
+    return stats->files_failed == 0 ? 0 : -1;
+}
+
+static int has_suffix(const char* s, const char* suffix) {
+    size_t length = strlen(s);
+    size_t suffix_length = strlen(suffix);
+
+    return length >= suffix_length && strcmp(s + length - suffix_length, suffix) == 0;
+}
+
+void add_batch_job(batch_list* list, const char* input, const char* output,
+                   const char* output_dir, const char* extension) {
+    batch_job* job;
+
+    if(list->num_jobs == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        list->jobs = realloc(list->jobs, list->capacity * sizeof(*list->jobs));
+    }
+    job = list->jobs + list->num_jobs++;
+    job->input = strdup(input);
+
+    if(output != NULL) {
+        job->output = strdup(output);
+    } else {
+        const char* slash = strrchr(input, '/');
+        const char* name = slash != NULL ? slash + 1 : input;
+        size_t name_length = strlen(name) - (has_suffix(name, ".cmp") ? 4 : 0);
+        size_t dir_length = output_dir != NULL ? strlen(output_dir) : (size_t)(name - input);
+        int separator = output_dir != NULL && dir_length > 0 && output_dir[dir_length - 1] != '/';
+        char* path = malloc(dir_length + separator + name_length + strlen(extension) + 1);
+
+        memcpy(path, output_dir != NULL ? output_dir : input, dir_length);
+        if(separator) {
+            path[dir_length] = '/';
+        }
+        memcpy(path + dir_length + separator, name, name_length);
+        strcpy(path + dir_length + separator + name_length, extension);
+        job->output = path;
+    }
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int add_batch_directory(batch_list* list, const char* dir, const char* output_dir,
+                        const char* extension) {
+    DIR* handle = opendir(dir);
+    struct dirent* dirent;
+    char** names = NULL;
+    size_t num_names = 0;
+    size_t capacity = 0;
+    size_t dir_length = strlen(dir);
+
+    if(handle == NULL) {
+        perror(dir);
+        return -1;
+    }
+
+    while((dirent = readdir(handle)) != NULL) {
+        if(!has_suffix(dirent->d_name, ".cmp")) {
+            continue;
+        }
+        if(num_names == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            names = realloc(names, capacity * sizeof(*names));
+        }
+        names[num_names++] = strdup(dirent->d_name);
+    }
+    closedir(handle);
+
+    qsort(names, num_names, sizeof(*names), compare_names);
+    for(size_t i = 0; i < num_names; ++i) {
+        char* path = malloc(dir_length + strlen(names[i]) + 2);
+        sprintf(path, dir_length > 0 && dir[dir_length - 1] == '/' ? "%s%s" : "%s/%s",
+                dir, names[i]);
+        add_batch_job(list, path, NULL, output_dir, extension);
+        free(path);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+int add_batch_list_file(batch_list* list, const char* filename, const char* output_dir,
+                        const char* extension) {
+    FILE* file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+
+    if(file == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    while((length = getline(&line, &line_capacity, file)) != -1) {
+        char* tab;
+
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if(length == 0 || line[0] == '#') {
+            continue;
+        }
+
+        tab = strchr(line, '\t');
+        if(tab != NULL) {
+            *tab = '\0';
+        }
+        add_batch_job(list, line, tab != NULL && tab[1] != '\0' ? tab + 1 : NULL,
+                      output_dir, extension);
+    }
+
+    free(line);
+    if(file != stdin) {
+        fclose(file);
+    }
+    return 0;
+}
+
+void free_batch_list(batch_list* list) {
+    for(int32_t i = 0; i < list->num_jobs; ++i) {
+        free(list->jobs[i].input);
+        free(list->jobs[i].output);
+    }
+    free(list->jobs);
+    memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,78 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinysynth.h"
+#include "sink.h"
+
+/* Renders many compositions in one process on a work-stealing pool. Each
+   worker has a deque of tasks: loading a file, or rendering one of its play
+   order entries. Loading a file plans its entries and pushes a task for
+   each onto the loader's own deque. A worker takes its own newest task
+   first, so it finishes the file it's on before starting another; an idle
+   worker steals another's oldest, which is a file not yet started or the
+   far end of a long one, so one long file can't leave the other workers
+   idle. Whoever renders a file's last entry writes it out and frees it.
+   Output is exactly what rendering each file on its own would give. */
+
+typedef struct _batch_job {
+    char* input;  /* .cmp file to render */
+    char* output; /* where the render goes */
+} batch_job;
+
+typedef struct _batch_list {
+    int32_t num_jobs;
+    int32_t capacity;
+    batch_job* jobs;
+} batch_list;
+
+typedef struct _batch_options {
+    int num_threads;         /* 0 or less for one per online CPU */
+    int8_t engine;           /* an osc_engine */
+    int8_t interpolate;
+    int8_t reuse_repeats;    /* copy repeated play order entries rather than
+                                rendering them again */
+    sink_container container;
+    sink_format format;
+    int use_mmap;
+    int discard;             /* render into null sinks */
+} batch_options;
+
+typedef struct _batch_stats {
+    int num_threads;         /* workers actually started */
+    int32_t files_rendered;
+    int32_t files_failed;
+    uint64_t samples;
+    uint64_t tasks;          /* files loaded plus entries rendered */
+    uint64_t tasks_stolen;
+    uint64_t repeats_reused; /* entries copied rather than rendered */
+} batch_stats;
+
+/* Adds a job to the list, copying both paths. A NULL output is worked out
+   from the input: output_dir (or the input's own directory if that is NULL)
+   joined with the input's name, its .cmp extension swapped for extension,
+   as given by sink_extension. */
+void add_batch_job(batch_list* list, const char* input, const char* output,
+                   const char* output_dir, const char* extension);
+
+/* Adds every .cmp file directly inside dir, in name order. Returns 0 on
+   success, -1 if the directory couldn't be read. */
+int add_batch_directory(batch_list* list, const char* dir, const char* output_dir,
+                        const char* extension);
+
+/* Adds the jobs listed in a file, one per line: an input path, optionally
+   followed by a tab and an output path. Blank lines and lines starting with
+   # are skipped. Returns 0 on success, -1 if the file couldn't be read. */
+int add_batch_list_file(batch_list* list, const char* filename, const char* output_dir,
+                        const char* extension);
+
+void free_batch_list(batch_list* list);
+
+/* Renders every job in the list. A file that fails to load or write is
+   reported and counted, and the rest carry on. Returns 0 if every file was
+   rendered, -1 otherwise. */
+int render_batch(const batch_list* list, const batch_options* options, batch_stats* stats);
+
+#endif
@@ -0,0 +1,452 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tinysynth.h"
+#include "voicebank.h"
+#include "composition.h"
+#include "rerender.h"
+
+/* Benchmarks the render path on synthetic compositions and checks that the
+   output hasn't changed. Each case is a composition using one oscillator
+   type (or all of them), rendered with every engine and kernel. The FNV-1a
+   hash of each render is compared with bench_hashes.txt; all kernels of an
+   engine must produce the same hash. Every configuration also makes random
+   note edits and checks that rerender_edits brings the render up to date
+   exactly as rendering it again does, with all the instruments' oscillators
+   and with only half of them. */
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_EDITS 12
+#define DEFAULT_HASH_FILE "bench_hashes.txt"
+#define MAX_HASHES 64
+
+typedef struct _bench_params {
+    int32_t num_sections;
+    int32_t num_instruments;
+    int32_t num_notes;
+    int32_t tempo;
+    int32_t play_order_length;
+    uint32_t seed;
+} bench_params;
+
+typedef struct _bench_case {
+    const char* name;
+    uint32_t types; /* bit mask of oscillator types to pick from */
+} bench_case;
+
+typedef struct _bench_config {
+    const char* engine_name; /* what the hash is stored under */
+    osc_engine engine;
+    int interpolate;
+    voice_kernel kernel;
+} bench_config;
+
+typedef struct _stored_hash {
+    char key[64];
+    uint64_t hash;
+} stored_hash;
+
+static const bench_case bench_cases[] = {
+    {"square", 1u << SQUARE},
+    {"sawtooth", 1u << SAWTOOTH},
+    {"triangle", 1u << TRIANGLE},
+    {"sine", 1u << SINE},
+    {"fm", 1u << FM},
+    {"mixed", (1u << SQUARE) | (1u << SAWTOOTH) | (1u << TRIANGLE) | (1u << SINE) | (1u << FM)}
+};
+
+static const bench_config bench_configs[] = {
+    {"libm", ENGINE_LIBM, 0, VOICE_KERNEL_SCALAR},
+    {"fixed", ENGINE_FIXED, 0, VOICE_KERNEL_SCALAR},
+    {"table", ENGINE_TABLE, 0, VOICE_KERNEL_SCALAR},
+    {"table", ENGINE_TABLE, 0, VOICE_KERNEL_SSE2},
+    {"table", ENGINE_TABLE, 0, VOICE_KERNEL_AVX2},
+    {"table-interp", ENGINE_TABLE, 1, VOICE_KERNEL_SCALAR},
+    {"table-interp", ENGINE_TABLE, 1, VOICE_KERNEL_SSE2},
+    {"table-interp", ENGINE_TABLE, 1, VOICE_KERNEL_AVX2}
+};
+
+#define NUM_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+#define NUM_CONFIGS (sizeof(bench_configs) / sizeof(bench_configs[0]))
+
+/* xorshift32, so a given seed builds the same composition everywhere. */
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int32_t random_between(uint32_t* state, int32_t low, int32_t high) {
+    return low + (int32_t)(next_random(state) % (uint32_t)(high - low + 1));
+}
+
+static int8_t random_type(uint32_t* state, uint32_t types) {
+    int8_t choices[8];
+    int num_choices = 0;
+
+    for(int8_t t = SQUARE; t <= FM; ++t) {
+        if(types & (1u << t)) {
+            choices[num_choices++] = t;
+        }
+    }
+    return choices[next_random(state) % num_choices];
+}
+
+/* Builds a composition of random melodies: mostly new pitches, with some
+   sustains and rests, and play order entries cycling through the sections
+   so the section cache has something to find. */
+static composition generate_composition(const bench_params* params, uint32_t types) {
+    composition comp;
+    uint32_t state = params->seed;
+
+    create_composition(&comp, params->play_order_length, params->num_sections,
+                       (size_t)params->num_sections * params->num_instruments,
+                       (size_t)params->num_sections * params->num_instruments * params->num_notes);
+
+    for(int32_t i = 0; i < comp.num_play_order; ++i) {
+        comp.play_order[i] = i % comp.num_sections;
+    }
+
+    for(int32_t s = 0; s < comp.num_sections; ++s) {
+        section* sec = comp.sections + s;
+
+        sec->tempo = params->tempo;
+        sec->num_instruments = params->num_instruments;
+        sec->num_notes = params->num_notes;
+        sec->instruments = allocate_instruments(&comp, sec->num_instruments);
+
+        for(int32_t i = 0; i < sec->num_instruments; ++i) {
+            instrument* inst = sec->instruments + i;
+
+            inst->type = random_type(&state, types);
+            inst->fm_numerator = random_between(&state, 1, 3);
+            inst->fm_denominator = random_between(&state, 1, 3);
+            inst->fm_gain = random_between(&state, 0, 300);
+            inst->notes = allocate_notes(&comp, sec->num_notes);
+
+            for(int32_t n = 0; n < sec->num_notes; ++n) {
+                int32_t roll = random_between(&state, 0, 9);
+
+                if(n > 0 && roll < 3) {
+                    inst->notes[n].pitch = 255;
+                } else if(roll < 4) {
+                    inst->notes[n].pitch = 0;
+                } else {
+                    inst->notes[n].pitch = random_between(&state, 24, 100);
+                }
+                inst->notes[n].gain = random_between(&state, 5, 20);
+            }
+        }
+    }
+
+    return comp;
+}
+
+/* Samples of sounding oscillator output the composition needs, the
+   denominator for ns per voice sample. */
+static uint64_t count_voice_samples(composition* comp, int32_t num_oscillators) {
+    uint64_t total = 0;
+
+    for(int32_t e = 0; e < comp->num_play_order; ++e) {
+        section* sec = comp->sections + comp->play_order[e];
+        uint64_t note_samples = samples_per_note(sec);
+
+        for(int32_t i = 0; i < sec->num_instruments && i < num_oscillators; ++i) {
+            uint8_t pitch = 0;
+            for(int32_t n = 0; n < sec->num_notes; ++n) {
+                if(sec->instruments[i].notes[n].pitch != 255) {
+                    pitch = sec->instruments[i].notes[n].pitch;
+                }
+                if(pitch != 0) {
+                    total += note_samples;
+                }
+            }
+        }
+    }
+    return total;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Renders the composition with one configuration, returning the hash of the
+   output and the time taken. */
+static uint64_t run_config(composition* comp, const bench_config* config, int32_t num_oscillators,
+                           uint64_t* samples, double* seconds) {
+    output_state* os = create_output_state(num_oscillators);
+    int32_t block[BENCH_BLOCK_SIZE];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t frames;
+    double start;
+
+    os->engine = config->engine;
+    os->interpolate = config->interpolate;
+    setup_output_state_for_composition(os, comp);
+
+    *samples = 0;
+    start = now_seconds();
+    while((frames = render_block(os, comp, block, BENCH_BLOCK_SIZE)) > 0) {
+        hash = fnv1a(hash, block, frames * sizeof(*block));
+        *samples += frames;
+    }
+    *seconds = now_seconds() - start;
+
+    free_output_state(os);
+    return hash;
+}
+
+static output_state* config_output_state(const bench_config* config, int32_t num_oscillators) {
+    output_state* os = create_output_state(num_oscillators);
+
+    os->engine = config->engine;
+    os->interpolate = config->interpolate;
+    return os;
+}
+
+static int32_t* render_whole(output_state* os, composition* comp, uint64_t length) {
+    int32_t* out = malloc(length * sizeof(*out));
+
+    setup_output_state_for_composition(os, comp);
+    render_block(os, comp, out, length);
+    return out;
+}
+
+/* Makes BENCH_EDITS random edits to distinct notes, brings a render from
+   before them up to date with rerender_edits and compares it with a render
+   made after, then puts the notes back. Returns 1 if they match. */
+static int check_rerender(composition* comp, const bench_config* config, int32_t num_oscillators,
+                          uint32_t seed) {
+    uint64_t length = composition_length(comp);
+    output_state* os = config_output_state(config, num_oscillators);
+    int32_t* updated = render_whole(os, comp, length);
+    int32_t* expected;
+    note_edit edits[BENCH_EDITS];
+    uint32_t state = seed;
+    int matches;
+
+    for(int32_t e = 0; e < BENCH_EDITS; ++e) {
+        note_edit* edit = edits + e;
+        note* cell;
+        int32_t roll;
+        int32_t repeat;
+
+        do {
+            edit->section = random_between(&state, 0, comp->num_sections - 1);
+            edit->instrument = random_between(&state, 0,
+                                              comp->sections[edit->section].num_instruments - 1);
+            edit->note = random_between(&state, 0, comp->sections[edit->section].num_notes - 1);
+            for(repeat = 0; repeat < e; ++repeat) {
+                if(edits[repeat].section == edit->section && edits[repeat].instrument == edit->instrument
+                   && edits[repeat].note == edit->note) {
+                    break;
+                }
+            }
+        } while(repeat < e);
+
+        cell = comp->sections[edit->section].instruments[edit->instrument].notes + edit->note;
+        edit->old = *cell;
+        roll = random_between(&state, 0, 9);
+        if(edit->note > 0 && roll < 3) {
+            cell->pitch = 255;
+        } else if(roll < 4) {
+            cell->pitch = 0;
+        } else {
+            cell->pitch = random_between(&state, 24, 100);
+        }
+        cell->gain = random_between(&state, 0, 100);
+    }
+
+    matches = rerender_edits(comp, os, updated, edits, BENCH_EDITS, NULL) == 0;
+    expected = render_whole(os, comp, length);
+    matches = matches && memcmp(updated, expected, length * sizeof(*updated)) == 0;
+
+    for(int32_t e = BENCH_EDITS - 1; e >= 0; --e) {
+        comp->sections[edits[e].section].instruments[edits[e].instrument].notes[edits[e].note]
+            = edits[e].old;
+    }
+
+    free(expected);
+    free_output_state(os);
+    free(updated);
+    return matches;
+}
+
+static int read_hashes(const char* filename, stored_hash* hashes) {
+    FILE* infile = fopen(filename, "r");
+    char line[256];
+    int count = 0;
+
+    if(infile == NULL) {
+        return 0;
+    }
+    while(count < MAX_HASHES && fgets(line, sizeof(line), infile) != NULL) {
+        unsigned long long hash;
+        if(line[0] == '#' || sscanf(line, "%63s %llx", hashes[count].key, &hash) != 2) {
+            continue;
+        }
+        hashes[count++].hash = hash;
+    }
+    fclose(infile);
+    return count;
+}
+
+static const stored_hash* find_hash(const stored_hash* hashes, int count, const char* key) {
+    for(int i = 0; i < count; ++i) {
+        if(strcmp(hashes[i].key, key) == 0) {
+            return hashes + i;
+        }
+    }
+    return NULL;
+}
+
+static void print_usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-s sections] [-i instruments] [-n notes] [-t tempo]\n"
+            "          [-p play order length] [-x seed] [-f hash file] [-w]\n"
+            "  -w  write the hashes of this run to the hash file instead of checking\n"
+            "Hashes are only checked with the default composition parameters.\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    bench_params params = {4, 16, 32, 240, 8, 0x7151};
+    int32_t num_oscillators;
+    const char* hash_file = DEFAULT_HASH_FILE;
+    int write_hashes = 0;
+    int custom = 0;
+    stored_hash hashes[MAX_HASHES];
+    int num_hashes = 0;
+    int failures = 0;
+    FILE* outfile = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:i:n:t:p:x:f:w")) != -1) {
+        switch(opt) {
+        case 's': params.num_sections = atoi(optarg); custom = 1; break;
+        case 'i': params.num_instruments = atoi(optarg); custom = 1; break;
+        case 'n': params.num_notes = atoi(optarg); custom = 1; break;
+        case 't': params.tempo = atoi(optarg); custom = 1; break;
+        case 'p': params.play_order_length = atoi(optarg); custom = 1; break;
+        case 'x': params.seed = strtoul(optarg, NULL, 0); custom = 1; break;
+        case 'f': hash_file = optarg; break;
+        case 'w': write_hashes = 1; break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(params.num_sections < 1 || params.num_instruments < 1 || params.num_notes < 1
+       || params.tempo < 1 || params.tempo > 32767 || params.play_order_length < 1 || params.seed == 0) {
+        fprintf(stderr, "Composition parameters out of range.\n");
+        return -1;
+    }
+    num_oscillators = params.num_instruments;
+
+    if(write_hashes) {
+        if(custom) {
+            fprintf(stderr, "Only the default parameters have stored hashes.\n");
+            return -1;
+        }
+        outfile = fopen(hash_file, "w");
+        if(outfile == NULL) {
+            perror(hash_file);
+            return -1;
+        }
+        fprintf(outfile, "# Reference output hashes for tinybench's default compositions.\n"
+                         "# Regenerate with ./tinybench -w only when output is meant to change.\n");
+    } else if(!custom) {
+        num_hashes = read_hashes(hash_file, hashes);
+    }
+
+    printf("%-9s %-13s %-7s %12s %16s %16s  %-12s %s\n",
+           "case", "engine", "kernel", "Msamples/s", "ns/voice-sample", "hash", "check",
+           "rerender");
+
+    for(size_t c = 0; c < NUM_CASES; ++c) {
+        composition comp = generate_composition(&params, bench_cases[c].types);
+        uint64_t voice_samples = count_voice_samples(&comp, num_oscillators);
+
+        for(size_t k = 0; k < NUM_CONFIGS; ++k) {
+            const bench_config* config = bench_configs + k;
+            voice_kernel kernel = select_voice_kernel(config->kernel);
+            char key[64];
+            const char* check = "-";
+            const char* rerender_check = "ok";
+            uint32_t edit_seed = params.seed + (uint32_t)(c * NUM_CONFIGS + k);
+            uint64_t samples;
+            double seconds;
+            uint64_t hash;
+
+            if(config->engine == ENGINE_TABLE && kernel != config->kernel) {
+                continue; /* not supported on this CPU */
+            }
+
+            hash = run_config(&comp, config, num_oscillators, &samples, &seconds);
+            snprintf(key, sizeof(key), "%s/%s", bench_cases[c].name, config->engine_name);
+
+            if(outfile != NULL) {
+                if(config->kernel == VOICE_KERNEL_SCALAR) {
+                    fprintf(outfile, "%s %016llx\n", key, (unsigned long long)hash);
+                }
+            } else if(!custom) {
+                const stored_hash* stored = find_hash(hashes, num_hashes, key);
+                if(stored == NULL) {
+                    check = "no reference";
+                } else if(stored->hash == hash) {
+                    check = "ok";
+                } else {
+                    check = "MISMATCH";
+                    ++failures;
+                }
+            }
+
+            if(!check_rerender(&comp, config, num_oscillators, edit_seed)
+               || !check_rerender(&comp, config, (num_oscillators + 1) / 2, edit_seed)) {
+                rerender_check = "MISMATCH";
+                ++failures;
+            }
+
+            printf("%-9s %-13s %-7s %12.2f %16.3f %016llx  %-12s %s\n",
+                   bench_cases[c].name, config->engine_name,
+                   config->engine == ENGINE_TABLE ? voice_kernel_name(kernel) : "-",
+                   samples / seconds / 1e6,
+                   voice_samples > 0 ? seconds * 1e9 / voice_samples : 0.0,
+                   (unsigned long long)hash, check, rerender_check);
+            fflush(stdout);
+        }
+
+        free_composition(&comp);
+    }
+
+    if(outfile != NULL) {
+        fclose(outfile);
+    }
+    if(failures > 0) {
+        printf("%d renders don't match their reference hashes or their re-renders.\n",
+               failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "composition.h"
+#include "trace.h"
+
+static const char magic[] = "TINYSYNTH";
+#define MAGIC_SIZE (sizeof(magic) - 1)
+
+/* Versioned files have this where version 1 files have their section
+   count, which can't be negative. */
+#define VERSIONED_MARKER -1
+#define FORMAT_VERSION 2
+
+/* Bytes an instrument takes before its notes. */
+#define INSTRUMENT_HEADER_SIZE 7
+
+/* Enough for the pointers in sections and instruments. */
+#define ARENA_ALIGNMENT 8
+
+/* Where the parse has got to in the mapped file. Every read goes through
+   take_bytes, so nothing past the end of the file is ever touched. */
+typedef struct _file_cursor {
+    const char* filename;
+    const uint8_t* data;
+    size_t size;
+    size_t offset;
+    int32_t version;
+    size_t index_offset; /* where the section offsets start, from version 2 */
+} file_cursor;
+
+static int malformed(const file_cursor* cursor, const char* what) {
+    fprintf(stderr, "%s: %s at byte %zu.\n", cursor->filename, what, cursor->offset);
+    return -1;
+}
+
+static const uint8_t* take_bytes(file_cursor* cursor, uint64_t size) {
+    const uint8_t* bytes = cursor->data + cursor->offset;
+
+    if(size > cursor->size - cursor->offset) {
+        return NULL;
+    }
+    cursor->offset += size;
+    return bytes;
+}
+
+/* Fields are stored in host byte order with no padding, so they're copied
+   out rather than dereferenced in place. */
+static int read_field(file_cursor* cursor, void* field, size_t size) {
+    const uint8_t* bytes = take_bytes(cursor, size);
+
+    if(bytes == NULL) {
+        return malformed(cursor, "file ends early");
+    }
+    memcpy(field, bytes, size);
+    return 0;
+}
+
+static int parse_instrument(file_cursor* cursor, instrument* inst, int32_t num_notes) {
+    const uint8_t* notes;
+
+    if(read_field(cursor, &inst->type, sizeof(inst->type)) != 0
+       || read_field(cursor, &inst->fm_numerator, sizeof(inst->fm_numerator)) != 0
+       || read_field(cursor, &inst->fm_denominator, sizeof(inst->fm_denominator)) != 0
+       || read_field(cursor, &inst->fm_gain, sizeof(inst->fm_gain)) != 0) {
+        return -1;
+    }
+    if(inst->type < SQUARE || inst->type > FM) {
+        return malformed(cursor, "unknown oscillator type");
+    }
+    if(inst->type == FM && inst->fm_denominator == 0) {
+        return malformed(cursor, "FM instrument with a zero denominator");
+    }
+
+    /* A note is two bytes with no alignment requirement, so the array in
+       the file is already the array the renderer wants. */
+    notes = take_bytes(cursor, (uint64_t)num_notes * sizeof(note));
+    if(notes == NULL) {
+        return malformed(cursor, "notes run past the end of the file");
+    }
+    inst->notes = (note*)notes;
+
+    for(int32_t k = 0; k < num_notes; ++k) {
+        if(inst->notes[k].gain > 100) {
+            return malformed(cursor, "note gain above 100");
+        }
+    }
+    if(num_notes > 0 && inst->notes[0].pitch == 255) {
+        return malformed(cursor, "section starts with a sustained note");
+    }
+    return 0;
+}
+
+/* Reads a section header, which has 8 bit counts in version 1 files and
+   32 bit counts from version 2, and checks the instruments it describes fit
+   in the rest of the file. */
+static int read_section_header(file_cursor* cursor, int16_t* tempo,
+                               int32_t* num_instruments, int32_t* num_notes) {
+    if(read_field(cursor, tempo, sizeof(*tempo)) != 0) {
+        return -1;
+    }
+    if(cursor->version == 1) {
+        int8_t counts[2];
+        if(read_field(cursor, counts, sizeof(counts)) != 0) {
+            return -1;
+        }
+        *num_instruments = counts[0];
+        *num_notes = counts[1];
+    } else if(read_field(cursor, num_instruments, sizeof(*num_instruments)) != 0
+              || read_field(cursor, num_notes, sizeof(*num_notes)) != 0) {
+        return -1;
+    }
+
+    if(*num_instruments < 0 || *num_notes < 0) {
+        return malformed(cursor, "negative instrument or note count");
+    }
+    if((uint64_t)*num_instruments * (INSTRUMENT_HEADER_SIZE + 2 * (uint64_t)*num_notes)
+       > cursor->size - cursor->offset) {
+        return malformed(cursor, "instruments run past the end of the file");
+    }
+    return 0;
+}
+
+/* Moves the cursor to the start of section i. Version 1 sections follow one
+   another, so the cursor is already there. Later versions look it up in the
+   section index. */
+static int seek_section(file_cursor* cursor, int32_t i) {
+    file_cursor index = *cursor;
+    uint64_t offset;
+
+    if(cursor->version == 1) {
+        return 0;
+    }
+    index.offset = cursor->index_offset + (size_t)i * sizeof(offset);
+    if(read_field(&index, &offset, sizeof(offset)) != 0) {
+        return -1;
+    }
+    if(offset > cursor->size) {
+        return malformed(&index, "section offset past the end of the file");
+    }
+    cursor->offset = offset;
+    return 0;
+}
+
+static int parse_section(file_cursor* cursor, composition* comp, section* sec) {
+    if(read_section_header(cursor, &sec->tempo, &sec->num_instruments, &sec->num_notes) != 0) {
+        return -1;
+    }
+    if(sec->tempo < 1) {
+        return malformed(cursor, "tempo below 1");
+    }
+
+    sec->instruments = allocate_instruments(comp, sec->num_instruments);
+    for(int32_t j = 0; j < sec->num_instruments; ++j) {
+        if(parse_instrument(cursor, sec->instruments + j, sec->num_notes) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads just the section headers, checking that every section fits in the
+   file and counting the instruments the arena needs room for. Versioned
+   files' offsets could point several sections at the same bytes, so the
+   sections together must also fit in the file, which bounds the count by
+   the file's size whatever the offsets say. */
+static int count_instruments(file_cursor cursor, int32_t num_sections, size_t* num_instruments) {
+    uint64_t total = 0;
+
+    *num_instruments = 0;
+
+    for(int32_t i = 0; i < num_sections; ++i) {
+        int16_t tempo;
+        int32_t instruments, notes;
+        size_t start;
+
+        if(seek_section(&cursor, i) != 0) {
+            return -1;
+        }
+        start = cursor.offset;
+        if(read_section_header(&cursor, &tempo, &instruments, &notes) != 0) {
+            return -1;
+        }
+        take_bytes(&cursor, (uint64_t)instruments * (INSTRUMENT_HEADER_SIZE + 2 * (uint64_t)notes));
+        total += cursor.offset - start;
+        if(total > cursor.size) {
+            return malformed(&cursor, "sections overlap");
+        }
+        *num_instruments += instruments;
+    }
+    return 0;
+}
+
+/* Reads everything up to the play order: the section and play order counts,
+   and in versioned files the version. */
+static int parse_file_header(file_cursor* cursor, int32_t* num_sections, int32_t* num_play_order) {
+    const uint8_t* header = take_bytes(cursor, MAGIC_SIZE);
+    int32_t first;
+
+    if(header == NULL || memcmp(header, magic, MAGIC_SIZE) != 0) {
+        return malformed(cursor, "not a TINYSYNTH file");
+    }
+    if(read_field(cursor, &first, sizeof(first)) != 0) {
+        return -1;
+    }
+    if(first == VERSIONED_MARKER) {
+        if(read_field(cursor, &cursor->version, sizeof(cursor->version)) != 0) {
+            return -1;
+        }
+        if(cursor->version != FORMAT_VERSION) {
+            return malformed(cursor, "unsupported format version");
+        }
+        if(read_field(cursor, num_sections, sizeof(*num_sections)) != 0) {
+            return -1;
+        }
+    } else {
+        cursor->version = 1;
+        *num_sections = first;
+    }
+    return read_field(cursor, num_play_order, sizeof(*num_play_order));
+}
+
+static int parse_composition(file_cursor* cursor, composition* comp) {
+    int32_t num_sections, num_play_order;
+    size_t num_instruments;
+    uint64_t play_order_size, section_space;
+    file_cursor sections;
+
+    if(parse_file_header(cursor, &num_sections, &num_play_order) != 0) {
+        return -1;
+    }
+    /* Checked before allocating anything, so a bad count can't ask for more
+       memory than the file could possibly describe. Each section takes at
+       least a 4 byte header, or an 8 byte index entry from version 2. */
+    play_order_size = (uint64_t)num_play_order * sizeof(int32_t);
+    section_space = (uint64_t)num_sections * (cursor->version == 1 ? 4 : sizeof(uint64_t));
+    if(num_sections < 0 || num_play_order < 0
+       || play_order_size > cursor->size - cursor->offset
+       || section_space > cursor->size - cursor->offset - play_order_size) {
+        return malformed(cursor, "section or play order count doesn't fit in the file");
+    }
+
+    sections = *cursor;
+    sections.offset += play_order_size;
+    sections.index_offset = sections.offset;
+    if(count_instruments(sections, num_sections, &num_instruments) != 0) {
+        return -1;
+    }
+    if(create_composition(comp, num_play_order, num_sections, num_instruments, 0) != 0) {
+        return malformed(cursor, "out of memory");
+    }
+
+    if(read_field(cursor, comp->play_order, play_order_size) != 0) {
+        return -1;
+    }
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        if(comp->play_order[i] < 0 || comp->play_order[i] >= comp->num_sections) {
+            return malformed(cursor, "play order names a section that doesn't exist");
+        }
+    }
+
+    cursor->index_offset = sections.index_offset;
+    for(int32_t i = 0; i < comp->num_sections; ++i) {
+        if(seek_section(cursor, i) != 0
+           || parse_section(cursor, comp, comp->sections + i) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parses size bytes of a file at data into comp, which is left empty on
+   failure. */
+static int parse_file(const char* filename, const void* data, size_t size, composition* comp) {
+    file_cursor cursor;
+
+    cursor.filename = filename;
+    cursor.data = data;
+    cursor.size = size;
+    cursor.offset = 0;
+    cursor.version = 0;
+    cursor.index_offset = 0;
+
+    if(parse_composition(&cursor, comp) != 0) {
+        free_composition(comp);
+        return -1;
+    }
+    if(cursor.version == 1 && cursor.offset != cursor.size) {
+        fprintf(stderr, "%s: ignoring %zu bytes after the last section.\n",
+                filename, cursor.size - cursor.offset);
+    }
+    return 0;
+}
+
+static int map_and_parse(const char* filename, composition* comp) {
+    struct stat info;
+    void* mapping;
+    int fd;
+
+    memset(comp, 0, sizeof(*comp));
+
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    if(fstat(fd, &info) != 0) {
+        perror(filename);
+        close(fd);
+        return -1;
+    }
+    if(info.st_size < (off_t)MAGIC_SIZE) {
+        fprintf(stderr, "%s: not a TINYSYNTH file.\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED) {
+        perror(filename);
+        return -1;
+    }
+
+    if(parse_file(filename, mapping, info.st_size, comp) != 0) {
+        munmap(mapping, info.st_size);
+        return -1;
+    }
+    comp->mapping = mapping;
+    comp->mapping_size = info.st_size;
+    return 0;
+}
+
+int load_composition(const char* filename, composition* comp) {
+    uint64_t start = TRACE_ON() ? trace_now_ns() : 0;
+    int ret = map_and_parse(filename, comp);
+
+    if(TRACE_ON()) {
+        trace_load(trace_now_ns() - start);
+    }
+    return ret;
+}
+
+int load_composition_copy(const char* name, void* data, size_t size, composition* comp) {
+    uint64_t start = TRACE_ON() ? trace_now_ns() : 0;
+    int ret;
+
+    memset(comp, 0, sizeof(*comp));
+    ret = parse_file(name, data, size, comp);
+    if(ret == 0) {
+        comp->mapping = data;
+        comp->mapping_size = size;
+        comp->mapping_copied = 1;
+    } else {
+        free(data);
+    }
+
+    if(TRACE_ON()) {
+        trace_load(trace_now_ns() - start);
+    }
+    return ret;
+}
+
+static size_t arena_round(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static void* arena_take(composition* comp, size_t size, size_t alignment) {
+    size_t start = (comp->arena_used + alignment - 1) & ~(alignment - 1);
+
+    if(start + size > comp->arena_size) {
+        fprintf(stderr, "Composition arena overflow, asked for %zu more bytes.\n", size);
+        abort();
+    }
+    comp->arena_used = start + size;
+    return comp->arena + start;
+}
+
+int create_composition(composition* comp, int32_t num_play_order, int32_t num_sections,
+                       size_t num_instruments, size_t num_notes) {
+    /* Instrument arrays are aligned, so each section may need some padding.
+       Note arrays aren't. */
+    size_t size = arena_round(num_play_order * sizeof(int32_t))
+                  + arena_round(num_sections * sizeof(section))
+                  + num_sections * (ARENA_ALIGNMENT - 1)
+                  + num_instruments * sizeof(instrument)
+                  + num_notes * sizeof(note);
+
+    memset(comp, 0, sizeof(*comp));
+    comp->arena = calloc(size, 1);
+    if(comp->arena == NULL) {
+        return -1;
+    }
+    comp->arena_size = size;
+
+    comp->num_play_order = num_play_order;
+    comp->play_order = arena_take(comp, num_play_order * sizeof(int32_t), ARENA_ALIGNMENT);
+    comp->num_sections = num_sections;
+    comp->sections = arena_take(comp, num_sections * sizeof(section), ARENA_ALIGNMENT);
+    return 0;
+}
+
+instrument* allocate_instruments(composition* comp, int32_t count) {
+    return arena_take(comp, count * sizeof(instrument), ARENA_ALIGNMENT);
+}
+
+note* allocate_notes(composition* comp, int32_t count) {
+    return arena_take(comp, count * sizeof(note), 1);
+}
+
+void free_composition(composition* comp) {
+    free(comp->arena);
+    if(comp->mapping_copied) {
+        free(comp->mapping);
+    } else if(comp->mapping != NULL) {
+        munmap(comp->mapping, comp->mapping_size);
+    }
+    memset(comp, 0, sizeof(*comp));
+}
+
+int32_t max_section_instruments(const composition* comp) {
+    int32_t most = 0;
+
+    for(int32_t i = 0; i < comp->num_sections; ++i) {
+        if(comp->sections[i].num_instruments > most) {
+            most = comp->sections[i].num_instruments;
+        }
+    }
+    return most;
+}
@@ -0,0 +1,49 @@
+#ifndef COMPOSITION_H
+#define COMPOSITION_H
+
+#include "tinysynth.h"
+
+/* Loads a composition in either version of the format described in
+   binformat.txt. The file is mapped rather than read, and instruments' notes
+   point straight into the mapping, so they're never copied. The mapping is
+   private: writing to a note changes the loaded composition, not the file.
+   Every count is checked against the size of the file, and anything that
+   would send the renderer outside its tables is rejected: play order entries
+   naming missing sections, unknown oscillator types, tempos below 1, gains
+   above 100, FM instruments with a zero denominator and sections that start
+   by sustaining.
+   Returns 0 on success. On failure it says what was wrong on stderr,
+   returns -1 and leaves comp empty. */
+int load_composition(const char* filename, composition* comp);
+
+/* Loads a composition from size bytes at data, a copy of a file made with
+   malloc, which the composition takes over whether or not it loads. Its
+   notes point into the copy, so unlike a mapped file's they stay as they
+   are whatever later happens to the file. name is only used in messages.
+   Otherwise as load_composition. */
+int load_composition_copy(const char* name, void* data, size_t size, composition* comp);
+
+/* A composition's play order, sections, instruments and notes are carved in
+   traversal order from a single zeroed block, the arena, sized up front from
+   the section headers. Walking a section touches one run of memory, and the
+   whole composition goes with one free. Loaded compositions leave their
+   notes in the mapping, which is already laid out in the same order.
+
+   create_composition sets comp up with an arena big enough for the given
+   totals, and allocates its play order and sections from it. Each section's
+   instruments and, for compositions built in memory, their notes are then
+   taken with allocate_instruments and allocate_notes, section by section.
+   Returns -1 if the arena can't be allocated. */
+int create_composition(composition* comp, int32_t num_play_order, int32_t num_sections,
+                       size_t num_instruments, size_t num_notes);
+instrument* allocate_instruments(composition* comp, int32_t count);
+note* allocate_notes(composition* comp, int32_t count);
+
+/* Frees everything a composition owns, leaving it empty. */
+void free_composition(composition* comp);
+
+/* The most instruments any section has, which is how many oscillators an
+   output state needs to play every instrument. */
+int32_t max_section_instruments(const composition* comp);
+
+#endif
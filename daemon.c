@@ -0,0 +1,957 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "tinysynth.h"
+#include "composition.h"
+#include "sectioncache.h"
+#include "seek.h"
+#include "voicebank.h"
+#include "wavetable.h"
+#include "fixedpoint.h"
+#include "trace.h"
+
+/* Samples rendered at a time for the parts of entries a range only partly
+   covers. */
+#define RENDER_BLOCK_SIZE 4096
+
+#define LISTEN_BACKLOG 64
+
+/* The most fields any request has. */
+#define MAX_FIELDS 5
+
+typedef struct _cached_composition {
+    uint64_t hash;        /* of the file's contents */
+    size_t file_size;
+    composition comp;
+    int32_t num_voices;
+    sample_index* index;
+    section_cache* sections;
+    pthread_mutex_t lock; /* guards sections */
+    size_t memory;        /* bytes counted against the cache limit */
+    int32_t users;        /* requests using it */
+    struct _cached_composition* newer;
+    struct _cached_composition* older;
+} cached_composition;
+
+typedef struct _daemon_stats {
+    uint64_t requests;
+    uint64_t failed;
+    uint64_t samples;          /* answered with, sent or written */
+    uint64_t samples_rendered;
+    uint64_t samples_copied;   /* from the section caches */
+    uint64_t composition_hits;
+    uint64_t composition_misses;
+    uint64_t section_hits;
+    uint64_t section_misses;
+} daemon_stats;
+
+struct _render_daemon;
+
+typedef struct _daemon_worker {
+    struct _render_daemon* daemon;
+    output_state* os; /* remade whenever a composition needs a different size */
+    int client;       /* connection being served, or -1 */
+    pthread_t thread;
+} daemon_worker;
+
+typedef struct _render_daemon {
+    const daemon_options* options;
+    pthread_mutex_t lock; /* guards everything below */
+    pthread_cond_t wake;
+    int stopping;
+    int* pending;         /* accepted connections no worker has taken yet */
+    size_t pending_capacity;
+    size_t pending_head;
+    size_t pending_tail;
+    cached_composition* newest;
+    cached_composition* oldest;
+    int32_t num_cached;
+    size_t memory_used;
+    uint64_t connections;
+    uint64_t evictions;
+    daemon_stats stats;
+    uint64_t start_ns;
+    daemon_worker* workers;
+    int num_workers;
+} render_daemon;
+
+/* Where a request's samples go: back down the connection, or to a sink. */
+typedef struct _render_output {
+    int client;
+    output_sink* sink;
+} render_output;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal) {
+    (void)signal;
+    stop_requested = 1;
+}
+
+/* 64 bit FNV-1a. */
+static uint64_t content_hash(const uint8_t* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Reads the whole file into a malloced buffer. Cached compositions are
+   parsed from copies like this rather than mapped, as clients rewrite their
+   files in place. Returns NULL and says why on failure. */
+static uint8_t* read_file(const char* filename, size_t* size) {
+    FILE* infile = fopen(filename, "rb");
+    uint8_t* data = NULL;
+    size_t capacity = 0;
+    size_t got;
+
+    *size = 0;
+    if(infile == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    do {
+        if(*size == capacity) {
+            uint8_t* grown;
+
+            capacity = capacity > 0 ? capacity * 2 : 1 << 16;
+            grown = realloc(data, capacity);
+            if(grown == NULL) {
+                break;
+            }
+            data = grown;
+        }
+        got = fread(data + *size, 1, capacity - *size, infile);
+        *size += got;
+    } while(got > 0);
+
+    if(*size < capacity && !ferror(infile)) {
+        uint8_t* shrunk = realloc(data, *size > 0 ? *size : 1);
+        data = shrunk != NULL ? shrunk : data;
+    } else {
+        perror(filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(infile);
+    return data;
+}
+
+static output_state* worker_output_state(daemon_worker* worker, int32_t num_voices) {
+    if(worker->os == NULL || worker->os->num_oscillators != num_voices) {
+        if(worker->os != NULL) {
+            free_output_state(worker->os);
+        }
+        worker->os = create_output_state(num_voices);
+        worker->os->engine = worker->daemon->options->engine;
+        worker->os->interpolate = worker->daemon->options->interpolate;
+    }
+    return worker->os;
+}
+
+/* Roughly what a cached composition holds before any sections are
+   rendered. */
+static size_t composition_memory(const cached_composition* cached) {
+    const composition* comp = &cached->comp;
+
+    return comp->mapping_size + comp->arena_size
+           + comp->num_play_order * (sizeof(entry_job) + cached->num_voices * sizeof(oscillator))
+           + comp->num_sections * sizeof(section_cache_entry);
+}
+
+static void free_cached_composition(cached_composition* cached) {
+    free_section_cache(cached->sections);
+    free_sample_index(cached->index);
+    free_composition(&cached->comp);
+    pthread_mutex_destroy(&cached->lock);
+    free(cached);
+}
+
+/* The cache is a list from most to least recently used. It holds few enough
+   compositions that a walk of it is cheap next to parsing one. Everything
+   from here to release_composition is called with the daemon's lock
+   held. */
+static cached_composition* find_cached(render_daemon* daemon, uint64_t hash, size_t size) {
+    for(cached_composition* cached = daemon->newest; cached != NULL; cached = cached->older) {
+        if(cached->hash == hash && cached->file_size == size) {
+            return cached;
+        }
+    }
+    return NULL;
+}
+
+static void unlink_cached(render_daemon* daemon, cached_composition* cached) {
+    if(cached->newer != NULL) {
+        cached->newer->older = cached->older;
+    } else {
+        daemon->newest = cached->older;
+    }
+    if(cached->older != NULL) {
+        cached->older->newer = cached->newer;
+    } else {
+        daemon->oldest = cached->newer;
+    }
+    cached->newer = cached->older = NULL;
+}
+
+static void link_newest(render_daemon* daemon, cached_composition* cached) {
+    cached->older = daemon->newest;
+    cached->newer = NULL;
+    if(daemon->newest != NULL) {
+        daemon->newest->newer = cached;
+    } else {
+        daemon->oldest = cached;
+    }
+    daemon->newest = cached;
+}
+
+static void use_cached(render_daemon* daemon, cached_composition* cached) {
+    cached->users++;
+    unlink_cached(daemon, cached);
+    link_newest(daemon, cached);
+}
+
+/* Drops the least recently used compositions nobody is using until the
+   cache fits its limit, or only ones in use are left. */
+static void evict_compositions(render_daemon* daemon) {
+    cached_composition* cached = daemon->oldest;
+
+    while(cached != NULL && daemon->memory_used > daemon->options->cache_limit) {
+        cached_composition* newer = cached->newer;
+
+        if(cached->users == 0) {
+            unlink_cached(daemon, cached);
+            daemon->memory_used -= cached->memory;
+            daemon->num_cached--;
+            daemon->evictions++;
+            free_cached_composition(cached);
+        }
+        cached = newer;
+    }
+}
+
+static void release_composition(render_daemon* daemon, cached_composition* cached) {
+    pthread_mutex_lock(&daemon->lock);
+    cached->users--;
+    evict_compositions(daemon);
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+/* Finds the composition in filename in the cache, or loads it into the
+   cache, and marks it in use. Returns NULL if it can't be read or
+   parsed. */
+static cached_composition* acquire_composition(daemon_worker* worker, const char* filename,
+                                               daemon_stats* counts) {
+    render_daemon* daemon = worker->daemon;
+    cached_composition* cached;
+    cached_composition* existing;
+    uint8_t* data;
+    uint64_t hash;
+    size_t size;
+
+    data = read_file(filename, &size);
+    if(data == NULL) {
+        return NULL;
+    }
+    hash = content_hash(data, size);
+
+    pthread_mutex_lock(&daemon->lock);
+    cached = find_cached(daemon, hash, size);
+    if(cached != NULL) {
+        use_cached(daemon, cached);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+    if(cached != NULL) {
+        free(data);
+        counts->composition_hits++;
+        return cached;
+    }
+
+    counts->composition_misses++;
+    cached = calloc(sizeof(cached_composition), 1);
+    if(cached == NULL) {
+        free(data);
+        return NULL;
+    }
+    if(load_composition_copy(filename, data, size, &cached->comp) != 0) {
+        free(cached);
+        return NULL;
+    }
+
+    cached->hash = hash;
+    cached->file_size = size;
+    cached->num_voices = max_section_instruments(&cached->comp);
+    if(cached->num_voices < 1) {
+        cached->num_voices = 1;
+    }
+    cached->index = build_sample_index(&cached->comp,
+                                       worker_output_state(worker, cached->num_voices));
+    cached->sections = create_section_cache(&cached->comp, daemon->options->cache_limit);
+    pthread_mutex_init(&cached->lock, NULL);
+    cached->memory = composition_memory(cached);
+
+    /* Another worker may have loaded the same file meanwhile. */
+    pthread_mutex_lock(&daemon->lock);
+    existing = find_cached(daemon, cached->hash, cached->file_size);
+    if(existing != NULL) {
+        use_cached(daemon, existing);
+    } else {
+        cached->users = 1;
+        link_newest(daemon, cached);
+        daemon->num_cached++;
+        daemon->memory_used += cached->memory;
+        evict_compositions(daemon);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    if(existing != NULL) {
+        free_cached_composition(cached);
+        return existing;
+    }
+    return cached;
+}
+
+static int send_all(int client, const void* data, size_t size) {
+    const char* bytes = data;
+
+    while(size > 0) {
+        ssize_t sent = send(client, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static int emit_samples(render_output* output, const int32_t* samples, size_t count) {
+    if(output->sink != NULL) {
+        return sink_write(output->sink, samples, count);
+    }
+    return send_all(output->client, samples, count * sizeof(*samples));
+}
+
+/* Renders a whole play order entry, or copies it from the section cache if
+   an earlier render of its section started in the same state. As with
+   render_play_order_entry, only a section's first render is kept. */
+static int render_whole_entry(daemon_worker* worker, cached_composition* cached, int32_t entry,
+                              render_output* output, daemon_stats* counts) {
+    render_daemon* daemon = worker->daemon;
+    composition* comp = &cached->comp;
+    const entry_job* job = cached->index->entries + entry;
+    int32_t section_index = comp->play_order[entry];
+    section_cache* sections = cached->sections;
+    section_cache_entry* section_entry = sections->entries + section_index;
+    output_state* os = worker->os;
+    size_t bytes = job->length * sizeof(int32_t);
+    const int32_t* samples = NULL;
+    int32_t* out;
+    int stored = 0;
+    int ret;
+
+    seek_output_state(os, cached->index, job->offset);
+
+    pthread_mutex_lock(&cached->lock);
+    if(section_entry->samples != NULL
+       && section_cache_matches(section_entry, os, comp->sections + section_index)) {
+        sections->hits++;
+        samples = section_entry->samples;
+    } else {
+        sections->misses++;
+    }
+    pthread_mutex_unlock(&cached->lock);
+
+    /* Cached samples are never changed or freed while the composition is in
+       use, so they're sent without the lock. */
+    if(samples != NULL) {
+        if(TRACE_ON()) {
+            trace_play_order_entry(os, comp, entry);
+        }
+        counts->section_hits++;
+        counts->samples_copied += job->length;
+        return emit_samples(output, samples, job->length);
+    }
+
+    counts->section_misses++;
+    out = malloc(bytes);
+    if(out == NULL) {
+        return -1;
+    }
+    render_block(os, comp, out, job->length);
+    counts->samples_rendered += job->length;
+    ret = emit_samples(output, out, job->length);
+
+    pthread_mutex_lock(&cached->lock);
+    if(section_entry->start == NULL && sections->memory_used + bytes <= sections->memory_limit) {
+        oscillator* start = malloc(cached->num_voices * sizeof(oscillator));
+
+        if(start != NULL) {
+            memcpy(start, job->start, cached->num_voices * sizeof(oscillator));
+            section_entry->start = start;
+            section_entry->samples = out;
+            section_entry->length = job->length;
+            sections->memory_used += bytes;
+            stored = 1;
+        }
+    }
+    pthread_mutex_unlock(&cached->lock);
+
+    if(stored) {
+        pthread_mutex_lock(&daemon->lock);
+        cached->memory += bytes;
+        daemon->memory_used += bytes;
+        evict_compositions(daemon);
+        pthread_mutex_unlock(&daemon->lock);
+    } else {
+        free(out);
+    }
+    return ret;
+}
+
+static int render_part_of_entry(daemon_worker* worker, cached_composition* cached,
+                                 uint64_t start, uint64_t length, render_output* output,
+                                 daemon_stats* counts) {
+    int32_t block[RENDER_BLOCK_SIZE];
+    int ret = seek_output_state(worker->os, cached->index, start);
+
+    while(ret == 0 && length > 0) {
+        size_t frames = render_block(worker->os, &cached->comp, block,
+                                     length < RENDER_BLOCK_SIZE ? length : RENDER_BLOCK_SIZE);
+        if(frames == 0) {
+            break;
+        }
+        counts->samples_rendered += frames;
+        ret = emit_samples(output, block, frames);
+        length -= frames;
+    }
+    return ret;
+}
+
+/* Renders length samples from start on, which must lie within the
+   composition, entry by entry. Entries the range covers whole go through
+   the section cache; the ends of entries it covers only partly are
+   rendered from a seek, and not cached. */
+static int render_cached_range(daemon_worker* worker, cached_composition* cached,
+                               uint64_t start, uint64_t length, render_output* output,
+                               daemon_stats* counts) {
+    const sample_index* index = cached->index;
+    uint64_t end = start + length;
+    sample_position position;
+    int ret = 0;
+
+    worker_output_state(worker, cached->num_voices);
+    if(length == 0 || locate_sample(index, start, &position) != 0) {
+        return 0;
+    }
+
+    for(int32_t entry = position.entry; entry < index->num_entries && ret == 0; ++entry) {
+        const entry_job* job = index->entries + entry;
+        uint64_t from, to;
+
+        if(job->offset >= end) {
+            break;
+        }
+        if(job->length == 0) {
+            continue;
+        }
+        from = start > job->offset ? start - job->offset : 0;
+        to = end < job->offset + job->length ? end - job->offset : job->length;
+        if(from == 0 && to == job->length) {
+            ret = render_whole_entry(worker, cached, entry, output, counts);
+        } else {
+            ret = render_part_of_entry(worker, cached, job->offset + from, to - from, output,
+                                       counts);
+        }
+    }
+    return ret;
+}
+
+/* The answer's first line. Returns -1 if the connection is gone. */
+static int send_status(int client, uint64_t count) {
+    char line[32];
+    int size = snprintf(line, sizeof(line), "ok %llu\n", (unsigned long long)count);
+
+    return send_all(client, line, size);
+}
+
+static int send_error(int client, const char* reason, daemon_stats* counts) {
+    char line[256];
+    int size = snprintf(line, sizeof(line), "error %s\n", reason);
+
+    counts->failed++;
+    if(size >= (int)sizeof(line)) {
+        size = sizeof(line) - 1;
+        line[size - 1] = '\n';
+    }
+    return send_all(client, line, size);
+}
+
+static int parse_count(const char* text, uint64_t* value) {
+    char* end;
+
+    if(text[0] < '0' || text[0] > '9') {
+        return -1;
+    }
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+/* render and range. Returns -1 if the connection can't carry on. */
+static int handle_render(daemon_worker* worker, char** fields, int num_fields, int ranged,
+                         daemon_stats* counts) {
+    const daemon_options* options = worker->daemon->options;
+    int client = worker->client;
+    const char* output_name = NULL;
+    uint64_t start = 0;
+    uint64_t length = UINT64_MAX;
+    uint64_t total;
+    cached_composition* cached;
+    render_output output;
+    char reason[128];
+    int ret;
+
+    if(ranged) {
+        if((num_fields != 4 && num_fields != 5) || parse_count(fields[2], &start) != 0
+           || parse_count(fields[3], &length) != 0) {
+            return send_error(client, "usage: range <composition> <start> <length> [<output>]",
+                              counts);
+        }
+        output_name = num_fields == 5 ? fields[4] : NULL;
+    } else {
+        if(num_fields != 2 && num_fields != 3) {
+            return send_error(client, "usage: render <composition> [<output>]", counts);
+        }
+        output_name = num_fields == 3 ? fields[2] : NULL;
+    }
+
+    /* open_sink takes "-" for stdout, which is the daemon's, not the
+       client's. */
+    if(output_name != NULL && strcmp(output_name, "-") == 0) {
+        return send_error(client, "output must be a file name, not -", counts);
+    }
+
+    cached = acquire_composition(worker, fields[1], counts);
+    if(cached == NULL) {
+        return send_error(client, "couldn't load the composition", counts);
+    }
+
+    total = cached->index->length;
+    if(start > total) {
+        release_composition(worker->daemon, cached);
+        snprintf(reason, sizeof(reason), "can't start at sample %llu of a %llu sample composition",
+                 (unsigned long long)start, (unsigned long long)total);
+        return send_error(client, reason, counts);
+    }
+    if(length > total - start) {
+        length = total - start;
+    }
+
+    output.client = client;
+    output.sink = NULL;
+    if(output_name != NULL) {
+        output.sink = open_sink(output_name, options->container, options->format, 1, 0, length);
+        if(output.sink == NULL) {
+            release_composition(worker->daemon, cached);
+            return send_error(client, "couldn't open the output", counts);
+        }
+        ret = render_cached_range(worker, cached, start, length, &output, counts);
+        if(close_sink(output.sink) != 0) {
+            ret = -1;
+        }
+        if(ret == 0) {
+            counts->samples += length;
+            ret = send_status(client, length);
+        } else {
+            ret = send_error(client, "couldn't write the output", counts);
+        }
+    } else {
+        /* Once the samples have started, a failure can only be reported by
+           dropping the connection. */
+        ret = send_status(client, length);
+        if(ret == 0) {
+            ret = render_cached_range(worker, cached, start, length, &output, counts);
+        }
+        if(ret == 0) {
+            counts->samples += length;
+        }
+    }
+
+    release_composition(worker->daemon, cached);
+    return ret;
+}
+
+static int handle_stats(daemon_worker* worker) {
+    render_daemon* daemon = worker->daemon;
+    const daemon_stats* stats = &daemon->stats;
+    char json[1024];
+    int size;
+
+    pthread_mutex_lock(&daemon->lock);
+    size = snprintf(json, sizeof(json),
+                    "{\n"
+                    "  \"uptime_ns\": %llu,\n"
+                    "  \"workers\": %d,\n"
+                    "  \"connections\": %llu,\n"
+                    "  \"requests\": %llu,\n"
+                    "  \"failed\": %llu,\n"
+                    "  \"samples\": %llu,\n"
+                    "  \"samples_rendered\": %llu,\n"
+                    "  \"samples_copied\": %llu,\n"
+                    "  \"compositions\": {\"cached\": %d, \"hits\": %llu, \"misses\": %llu,"
+                    " \"evictions\": %llu},\n"
+                    "  \"sections\": {\"hits\": %llu, \"misses\": %llu},\n"
+                    "  \"cache\": {\"bytes\": %llu, \"limit\": %llu}\n"
+                    "}\n",
+                    (unsigned long long)(trace_now_ns() - daemon->start_ns), daemon->num_workers,
+                    (unsigned long long)daemon->connections, (unsigned long long)stats->requests,
+                    (unsigned long long)stats->failed, (unsigned long long)stats->samples,
+                    (unsigned long long)stats->samples_rendered,
+                    (unsigned long long)stats->samples_copied, (int)daemon->num_cached,
+                    (unsigned long long)stats->composition_hits,
+                    (unsigned long long)stats->composition_misses,
+                    (unsigned long long)daemon->evictions,
+                    (unsigned long long)stats->section_hits,
+                    (unsigned long long)stats->section_misses,
+                    (unsigned long long)daemon->memory_used,
+                    (unsigned long long)daemon->options->cache_limit);
+    pthread_mutex_unlock(&daemon->lock);
+
+    if(send_status(worker->client, size) != 0) {
+        return -1;
+    }
+    return send_all(worker->client, json, size);
+}
+
+static void add_stats(render_daemon* daemon, const daemon_stats* counts) {
+    daemon_stats* stats = &daemon->stats;
+
+    pthread_mutex_lock(&daemon->lock);
+    stats->requests += counts->requests;
+    stats->failed += counts->failed;
+    stats->samples += counts->samples;
+    stats->samples_rendered += counts->samples_rendered;
+    stats->samples_copied += counts->samples_copied;
+    stats->composition_hits += counts->composition_hits;
+    stats->composition_misses += counts->composition_misses;
+    stats->section_hits += counts->section_hits;
+    stats->section_misses += counts->section_misses;
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+/* Answers the worker's connection's requests until it closes or the daemon
+   stops, then closes it. */
+static void serve_client(daemon_worker* worker) {
+    render_daemon* daemon = worker->daemon;
+    FILE* in = fdopen(worker->client, "r");
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+
+    while(in != NULL && (length = getline(&line, &line_capacity, in)) != -1) {
+        char* fields[MAX_FIELDS + 1];
+        int num_fields = 0;
+        daemon_stats counts;
+        int ret;
+
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if(length == 0) {
+            continue;
+        }
+
+        for(char* field = line; field != NULL && num_fields <= MAX_FIELDS; ++num_fields) {
+            char* tab = strchr(field, '\t');
+
+            fields[num_fields] = field;
+            if(tab != NULL) {
+                *tab = '\0';
+                field = tab + 1;
+            } else {
+                field = NULL;
+            }
+        }
+
+        memset(&counts, 0, sizeof(counts));
+        counts.requests = 1;
+        if(num_fields > MAX_FIELDS) {
+            ret = send_error(worker->client, "too many fields", &counts);
+        } else if(strcmp(fields[0], "render") == 0) {
+            ret = handle_render(worker, fields, num_fields, 0, &counts);
+        } else if(strcmp(fields[0], "range") == 0) {
+            ret = handle_render(worker, fields, num_fields, 1, &counts);
+        } else if(strcmp(fields[0], "stats") == 0) {
+            ret = handle_stats(worker);
+        } else {
+            ret = send_error(worker->client, "unknown request", &counts);
+        }
+        add_stats(daemon, &counts);
+        if(ret != 0) {
+            break;
+        }
+    }
+    free(line);
+
+    /* Cleared first, so the daemon never shuts down a descriptor that has
+       been reused. */
+    pthread_mutex_lock(&daemon->lock);
+    if(in == NULL) {
+        close(worker->client);
+    }
+    worker->client = -1;
+    pthread_mutex_unlock(&daemon->lock);
+    if(in != NULL) {
+        fclose(in);
+    }
+}
+
+static void* daemon_worker_main(void* arg) {
+    daemon_worker* worker = arg;
+    render_daemon* daemon = worker->daemon;
+
+    for(;;) {
+        pthread_mutex_lock(&daemon->lock);
+        while(daemon->pending_head == daemon->pending_tail && !daemon->stopping) {
+            pthread_cond_wait(&daemon->wake, &daemon->lock);
+        }
+        if(daemon->stopping) {
+            pthread_mutex_unlock(&daemon->lock);
+            break;
+        }
+        worker->client = daemon->pending[daemon->pending_head++];
+        pthread_mutex_unlock(&daemon->lock);
+
+        serve_client(worker);
+    }
+    return NULL;
+}
+
+static void queue_client(render_daemon* daemon, int client) {
+    pthread_mutex_lock(&daemon->lock);
+    if(daemon->pending_tail == daemon->pending_capacity) {
+        if(daemon->pending_head > 0) {
+            memmove(daemon->pending, daemon->pending + daemon->pending_head,
+                    (daemon->pending_tail - daemon->pending_head) * sizeof(*daemon->pending));
+            daemon->pending_tail -= daemon->pending_head;
+            daemon->pending_head = 0;
+        } else {
+            daemon->pending_capacity = daemon->pending_capacity > 0 ? daemon->pending_capacity * 2
+                                                                     : 64;
+            daemon->pending = realloc(daemon->pending,
+                                      daemon->pending_capacity * sizeof(*daemon->pending));
+        }
+    }
+    daemon->pending[daemon->pending_tail++] = client;
+    daemon->connections++;
+    pthread_cond_signal(&daemon->wake);
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+/* A socket file nothing is listening on, left by a daemon that didn't get
+   to remove it. */
+static int is_stale_socket(const struct sockaddr_un* address) {
+    struct stat info;
+    int fd;
+    int stale;
+
+    if(stat(address->sun_path, &info) != 0 || !S_ISSOCK(info.st_mode)) {
+        return 0;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    stale = connect(fd, (const struct sockaddr*)address, sizeof(*address)) != 0
+            && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+static int open_listener(const char* path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path too long.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        if(errno != EADDRINUSE) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        if(!is_stale_socket(&address)) {
+            fprintf(stderr, "%s: already in use.\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        if(bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    if(listen(fd, LISTEN_BACKLOG) != 0) {
+        perror(path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_renders(const daemon_options* options) {
+    render_daemon daemon;
+    sigset_t stop_signals, old_mask, waiting_mask;
+    struct sigaction action;
+    int num_threads = options->num_threads;
+    int started = 0;
+    int listener = open_listener(options->socket_path);
+
+    if(listener < 0) {
+        return -1;
+    }
+    if(num_threads <= 0) {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(num_threads < 1) {
+        num_threads = 1;
+    }
+
+    /* The one-time table setup and kernel choice are done here, so they
+       never run on two workers at once. */
+    init_wavetables();
+    init_fixed_tables();
+    current_voice_kernel();
+
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.options = options;
+    pthread_mutex_init(&daemon.lock, NULL);
+    pthread_cond_init(&daemon.wake, NULL);
+    daemon.start_ns = trace_now_ns();
+    daemon.workers = calloc(sizeof(daemon_worker), num_threads);
+
+    /* Stop signals are blocked everywhere but in the wait for connections,
+       so they never interrupt a worker. */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+    waiting_mask = old_mask;
+    sigdelset(&waiting_mask, SIGINT);
+    sigdelset(&waiting_mask, SIGTERM);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for(; started < num_threads; ++started) {
+        daemon.workers[started].daemon = &daemon;
+        daemon.workers[started].client = -1;
+        if(pthread_create(&daemon.workers[started].thread, NULL, daemon_worker_main,
+                          daemon.workers + started) != 0) {
+            fprintf(stderr, "Couldn't start daemon thread %d, carrying on with %d.\n",
+                    started, started);
+            break;
+        }
+    }
+    daemon.num_workers = started;
+
+    if(started > 0) {
+        fprintf(stderr, "Serving renders on %s with %d workers.\n", options->socket_path,
+                started);
+    }
+    while(started > 0 && !stop_requested) {
+        fd_set ready;
+        int client;
+
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        if(pselect(listener + 1, &ready, NULL, NULL, NULL, &waiting_mask) < 0) {
+            if(errno != EINTR) {
+                perror("pselect");
+                break;
+            }
+            continue;
+        }
+        client = accept(listener, NULL, NULL);
+        if(client >= 0) {
+            queue_client(&daemon, client);
+        }
+    }
+
+    /* Requests in progress finish, but nothing more is read. */
+    pthread_mutex_lock(&daemon.lock);
+    daemon.stopping = 1;
+    for(int i = 0; i < started; ++i) {
+        if(daemon.workers[i].client >= 0) {
+            shutdown(daemon.workers[i].client, SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&daemon.wake);
+    pthread_mutex_unlock(&daemon.lock);
+
+    for(int i = 0; i < started; ++i) {
+        pthread_join(daemon.workers[i].thread, NULL);
+    }
+    for(size_t i = daemon.pending_head; i < daemon.pending_tail; ++i) {
+        close(daemon.pending[i]);
+    }
+    close(listener);
+    unlink(options->socket_path);
+
+    fprintf(stderr, "Served %llu requests on %llu connections, %llu failed.\n",
+            (unsigned long long)daemon.stats.requests, (unsigned long long)daemon.connections,
+            (unsigned long long)daemon.stats.failed);
+
+    while(daemon.newest != NULL) {
+        cached_composition* cached = daemon.newest;
+        unlink_cached(&daemon, cached);
+        free_cached_composition(cached);
+    }
+    for(int i = 0; i < num_threads; ++i) {
+        if(daemon.workers[i].os != NULL) {
+            free_output_state(daemon.workers[i].os);
+        }
+    }
+    free(daemon.workers);
+    free(daemon.pending);
+    pthread_cond_destroy(&daemon.wake);
+    pthread_mutex_destroy(&daemon.lock);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return started > 0 ? 0 : -1;
+}
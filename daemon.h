@@ -0,0 +1,58 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sink.h"
+
+/* A long running renderer serving requests on a Unix domain socket, so
+   tools asking for many small renders don't pay for a process start and a
+   parse each time.
+
+   Loaded compositions are kept in a cache keyed by a hash of the file's
+   contents, so a file is parsed again only when it changes, whatever it is
+   called. Each is parsed from the daemon's own copy of the file, so nothing
+   a client does to the file afterwards can reach a cached composition. Each
+   cached composition carries its sample index, for range renders, and a
+   section cache of the play order entries rendered whole so far, which any
+   later request covering them copies rather than renders.
+   When the cache grows past its memory limit the least recently used
+   compositions not in use are dropped, sections and all.
+
+   Connections are served by a pool of workers, one connection per worker at
+   a time. A connection can send any number of requests, answered in order.
+   Each request is one line of tab separated fields:
+
+       render <composition> [<output>]
+       range <composition> <start> <length> [<output>]
+       stats
+
+   and is answered with a line of "ok <count>" or "error <reason>". A render
+   or range answers with the samples rendered; without an output file they
+   follow as count native endian 32 bit samples, otherwise they have been
+   written to the file in the daemon's container and format. An output of
+   "-" is an error rather than stdout; leave it out to have the samples
+   follow the reply. A range past the end of the composition is cut short
+   there. stats answers with count bytes of JSON counters.
+
+   Every request renders with the daemon's engine settings, so cached
+   sections are always from the same configuration. */
+
+typedef struct _daemon_options {
+    const char* socket_path;
+    int num_threads;         /* 0 or less for one per online CPU */
+    int8_t engine;           /* an osc_engine */
+    int8_t interpolate;
+    size_t cache_limit;      /* bytes of compositions and sections to keep */
+    sink_container container; /* for renders written to files */
+    sink_format format;
+} daemon_options;
+
+/* Serves requests until SIGINT or SIGTERM, then lets the requests in
+   progress finish and removes the socket. A stale socket left by a daemon
+   that is no longer running is replaced. Returns 0 after a clean stop, -1
+   if the socket couldn't be set up. */
+int serve_renders(const daemon_options* options);
+
+#endif
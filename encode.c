@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "encode.h"
+#include "tinysynth.h"
+#include "voicebank.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENCODE_X86 1
+#include <immintrin.h>
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+#define RICE_VERSION 1
+
+/* Quotients this big are written as an escape followed by the value in
+   full, so no residual takes more than 64 bits. */
+#define RICE_ESCAPE 32
+
+static inline uint32_t xorshift32(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+void init_dither(dither_state* dither, uint32_t seed) {
+    for(int i = 0; i < DITHER_STREAMS; ++i) {
+        /* xorshift32 is stuck at zero, so mix the seed and keep it odd. */
+        dither->streams[i] = (seed ^ (0x9e3779b9u * (i + 1))) | 1;
+    }
+    dither->position = 0;
+}
+
+/* Rounds the top 16 bits of sample with the dither noise drawn from random,
+   the low 16 bits plus noise plus a half carrying into them. Nothing here
+   can overflow: the carry is -1 to 2 and the result is saturated. */
+static inline int16_t dither_sample(int32_t sample, uint32_t random) {
+    int32_t noise = (int32_t)(random & 0xffff) + (int32_t)(random >> 16) - 0xffff;
+    int32_t carry = ((sample & 0xffff) + noise + 0x8000) >> 16;
+    int32_t value = (sample >> 16) + carry;
+
+    if(value > INT16_MAX) {
+        return INT16_MAX;
+    } else if(value < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)value;
+}
+
+static void encode_s16_scalar(dither_state* dither, int16_t* out, const int32_t* in,
+                              size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        uint32_t* stream = dither->streams + (dither->position++ % DITHER_STREAMS);
+
+        *stream = xorshift32(*stream);
+        out[i] = dither_sample(in[i], *stream);
+    }
+}
+
+static void encode_f32_scalar(float* out, const int32_t* in, size_t count) {
+    for(size_t i = 0; i < count; ++i) {
+        out[i] = (float)in[i] * (1.0f / 2147483648.0f);
+    }
+}
+
+#ifdef ENCODE_X86
+
+SSE2_FUNCTION static inline __m128i sse2_xorshift32(__m128i x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+SSE2_FUNCTION static inline __m128i sse2_dither(__m128i sample, __m128i random) {
+    const __m128i low_mask = _mm_set1_epi32(0xffff);
+    __m128i noise = _mm_sub_epi32(_mm_add_epi32(_mm_and_si128(random, low_mask),
+                                                _mm_srli_epi32(random, 16)),
+                                  low_mask);
+    __m128i carry = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_and_si128(sample, low_mask), noise),
+                                                 _mm_set1_epi32(0x8000)), 16);
+    return _mm_add_epi32(_mm_srai_epi32(sample, 16), carry);
+}
+
+/* Eight samples at a time, the first four from generators 0 to 3 and the
+   rest from 4 to 7; the pack saturates. */
+SSE2_FUNCTION static void encode_s16_sse2(dither_state* dither, int16_t* out, const int32_t* in,
+                                          size_t count) {
+    size_t head = (DITHER_STREAMS - dither->position % DITHER_STREAMS) % DITHER_STREAMS;
+    size_t i;
+    __m128i low, high;
+
+    if(head > count) {
+        head = count;
+    }
+    encode_s16_scalar(dither, out, in, head);
+
+    low = _mm_loadu_si128((const __m128i*)dither->streams);
+    high = _mm_loadu_si128((const __m128i*)(dither->streams + 4));
+    for(i = head; i + DITHER_STREAMS <= count; i += DITHER_STREAMS) {
+        low = sse2_xorshift32(low);
+        high = sse2_xorshift32(high);
+        _mm_storeu_si128((__m128i*)(out + i),
+                         _mm_packs_epi32(sse2_dither(_mm_loadu_si128((const __m128i*)(in + i)), low),
+                                         sse2_dither(_mm_loadu_si128((const __m128i*)(in + i + 4)), high)));
+    }
+    _mm_storeu_si128((__m128i*)dither->streams, low);
+    _mm_storeu_si128((__m128i*)(dither->streams + 4), high);
+    dither->position += i - head;
+
+    encode_s16_scalar(dither, out + i, in + i, count - i);
+}
+
+SSE2_FUNCTION static void encode_f32_sse2(float* out, const int32_t* in, size_t count) {
+    const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+    size_t i;
+
+    for(i = 0; i + 4 <= count; i += 4) {
+        __m128i samples = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(samples), scale));
+    }
+    encode_f32_scalar(out + i, in + i, count - i);
+}
+
+AVX2_FUNCTION static inline __m256i avx2_xorshift32(__m256i x) {
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+    return _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+}
+
+AVX2_FUNCTION static inline __m256i avx2_dither(__m256i sample, __m256i random) {
+    const __m256i low_mask = _mm256_set1_epi32(0xffff);
+    __m256i noise = _mm256_sub_epi32(_mm256_add_epi32(_mm256_and_si256(random, low_mask),
+                                                      _mm256_srli_epi32(random, 16)),
+                                     low_mask);
+    __m256i carry = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(sample, low_mask), noise),
+                                                       _mm256_set1_epi32(0x8000)), 16);
+    return _mm256_add_epi32(_mm256_srai_epi32(sample, 16), carry);
+}
+
+/* The pack works within 128 bit halves, so the halves' results are put back
+   in order with a permute. */
+AVX2_FUNCTION static void encode_s16_avx2(dither_state* dither, int16_t* out, const int32_t* in,
+                                          size_t count) {
+    size_t head = (DITHER_STREAMS - dither->position % DITHER_STREAMS) % DITHER_STREAMS;
+    size_t i;
+    __m256i streams;
+
+    if(head > count) {
+        head = count;
+    }
+    encode_s16_scalar(dither, out, in, head);
+
+    streams = _mm256_loadu_si256((const __m256i*)dither->streams);
+    for(i = head; i + DITHER_STREAMS <= count; i += DITHER_STREAMS) {
+        __m256i values;
+
+        streams = avx2_xorshift32(streams);
+        values = avx2_dither(_mm256_loadu_si256((const __m256i*)(in + i)), streams);
+        values = _mm256_permute4x64_epi64(_mm256_packs_epi32(values, values), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(values));
+    }
+    _mm256_storeu_si256((__m256i*)dither->streams, streams);
+    dither->position += i - head;
+
+    encode_s16_scalar(dither, out + i, in + i, count - i);
+}
+
+AVX2_FUNCTION static void encode_f32_avx2(float* out, const int32_t* in, size_t count) {
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    size_t i;
+
+    for(i = 0; i + 8 <= count; i += 8) {
+        __m256i samples = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+    }
+    encode_f32_scalar(out + i, in + i, count - i);
+}
+
+#endif
+
+void encode_s16(dither_state* dither, int16_t* out, const int32_t* in, size_t count) {
+    switch(current_voice_kernel()) {
+#ifdef ENCODE_X86
+    case VOICE_KERNEL_AVX2:
+        encode_s16_avx2(dither, out, in, count);
+        break;
+    case VOICE_KERNEL_SSE2:
+        encode_s16_sse2(dither, out, in, count);
+        break;
+#endif
+    default:
+        encode_s16_scalar(dither, out, in, count);
+        break;
+    }
+}
+
+void encode_f32(float* out, const int32_t* in, size_t count) {
+    switch(current_voice_kernel()) {
+#ifdef ENCODE_X86
+    case VOICE_KERNEL_AVX2:
+        encode_f32_avx2(out, in, count);
+        break;
+    case VOICE_KERNEL_SSE2:
+        encode_f32_sse2(out, in, count);
+        break;
+#endif
+    default:
+        encode_f32_scalar(out, in, count);
+        break;
+    }
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+rice_encoder* create_rice_encoder(int channels) {
+    rice_encoder* encoder = calloc(sizeof(rice_encoder), 1);
+
+    encoder->channels = channels;
+    encoder->history = calloc(sizeof(uint32_t), 2 * (size_t)channels);
+    encoder->residuals = malloc(RICE_BLOCK_FRAMES * sizeof(uint32_t));
+    return encoder;
+}
+
+void free_rice_encoder(rice_encoder* encoder) {
+    if(encoder == NULL) {
+        return;
+    }
+    free(encoder->history);
+    free(encoder->residuals);
+    free(encoder);
+}
+
+void make_rice_header(uint8_t* header, int channels) {
+    memcpy(header, "TSRICE", 6);
+    header[6] = RICE_VERSION;
+    header[7] = 0;
+    put_le32(header + 8, sample_rate);
+    put_le32(header + 12, channels);
+}
+
+size_t rice_block_bound(int channels, size_t frames) {
+    return 4 + 2 * (size_t)channels + frames * channels * 8 + 1;
+}
+
+/* Residuals are wrapping differences, so map them to unsigned with small
+   magnitudes either way staying small. */
+static inline uint32_t zigzag(uint32_t residual) {
+    return (residual << 1) ^ (uint32_t)-(int32_t)(residual >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ (uint32_t)-(int32_t)(value & 1);
+}
+
+/* What each order predicts from the last two samples, newest first. */
+static inline uint32_t predict(int order, uint32_t last, uint32_t before) {
+    switch(order) {
+    case 1:
+        return last;
+    case 2:
+        return 2 * last - before;
+    default:
+        return 0;
+    }
+}
+
+typedef struct _bit_writer {
+    uint8_t* out;
+    size_t used;
+    uint64_t bits; /* the low count bits are still to be written */
+    int count;
+} bit_writer;
+
+/* Writes the low n bits of value, most significant first; n is at most
+   32. */
+static inline void put_bits(bit_writer* writer, uint32_t value, int n) {
+    writer->bits = (writer->bits << n) | (value & (uint32_t)(((uint64_t)1 << n) - 1));
+    writer->count += n;
+    while(writer->count >= 8) {
+        writer->count -= 8;
+        writer->out[writer->used++] = (uint8_t)(writer->bits >> writer->count);
+    }
+}
+
+static inline void put_rice(bit_writer* writer, uint32_t value, int k) {
+    uint32_t quotient = value >> k;
+
+    if(quotient >= RICE_ESCAPE) {
+        put_bits(writer, UINT32_MAX, RICE_ESCAPE);
+        put_bits(writer, value, 32);
+        return;
+    }
+    /* quotient ones and a terminating zero */
+    put_bits(writer, (uint32_t)(((uint64_t)1 << (quotient + 1)) - 2), quotient + 1);
+    if(k > 0) {
+        put_bits(writer, value, k);
+    }
+}
+
+/* The parameter that roughly minimises the coded size of values adding up
+   to sum: the bit length of their mean. */
+static int rice_parameter(uint64_t sum, size_t count) {
+    int k = 0;
+
+    while(k < 31 && ((uint64_t)count << (k + 1)) <= sum) {
+        ++k;
+    }
+    return k;
+}
+
+size_t encode_rice_block(rice_encoder* encoder, uint8_t* out, const int32_t* samples,
+                         size_t frames) {
+    int channels = encoder->channels;
+    uint8_t* params = out + 4;
+    bit_writer writer;
+
+    put_le32(out, (uint32_t)frames);
+    writer.out = out;
+    writer.used = 4 + 2 * (size_t)channels;
+    writer.bits = 0;
+    writer.count = 0;
+
+    for(int c = 0; c < channels; ++c) {
+        uint32_t* history = encoder->history + 2 * c;
+        uint64_t sums[RICE_MAX_ORDER + 1] = {0};
+        uint32_t last = history[0], before = history[1];
+        int order = 0, k;
+
+        for(size_t i = 0; i < frames; ++i) {
+            uint32_t sample = (uint32_t)samples[i * channels + c];
+            for(int o = 0; o <= RICE_MAX_ORDER; ++o) {
+                sums[o] += zigzag(sample - predict(o, last, before));
+            }
+            before = last;
+            last = sample;
+        }
+        for(int o = 1; o <= RICE_MAX_ORDER; ++o) {
+            if(sums[o] < sums[order]) {
+                order = o;
+            }
+        }
+        k = rice_parameter(sums[order], frames);
+
+        last = history[0];
+        before = history[1];
+        for(size_t i = 0; i < frames; ++i) {
+            uint32_t sample = (uint32_t)samples[i * channels + c];
+            put_rice(&writer, zigzag(sample - predict(order, last, before)), k);
+            before = last;
+            last = sample;
+        }
+        history[0] = last;
+        history[1] = before;
+
+        params[2 * c] = (uint8_t)order;
+        params[2 * c + 1] = (uint8_t)k;
+    }
+
+    if(writer.count > 0) {
+        put_bits(&writer, 0, 8 - writer.count);
+    }
+    return writer.used;
+}
+
+typedef struct _bit_reader {
+    const uint8_t* data;
+    size_t size;
+    size_t used; /* whole bytes taken into bits */
+    uint64_t bits;
+    int count;
+} bit_reader;
+
+/* Reads n bits, at most 32. Returns -1 if the data runs out. */
+static int get_bits(bit_reader* reader, int n, uint32_t* value) {
+    while(reader->count < n) {
+        if(reader->used >= reader->size) {
+            return -1;
+        }
+        reader->bits = (reader->bits << 8) | reader->data[reader->used++];
+        reader->count += 8;
+    }
+    reader->count -= n;
+    *value = (uint32_t)((reader->bits >> reader->count) & (((uint64_t)1 << n) - 1));
+    return 0;
+}
+
+static int get_rice(bit_reader* reader, int k, uint32_t* value) {
+    uint32_t quotient = 0, bit, remainder = 0;
+
+    for(;;) {
+        if(get_bits(reader, 1, &bit) != 0) {
+            return -1;
+        }
+        if(bit == 0) {
+            break;
+        }
+        if(++quotient == RICE_ESCAPE) {
+            return get_bits(reader, 32, value);
+        }
+    }
+    if(k > 0 && get_bits(reader, k, &remainder) != 0) {
+        return -1;
+    }
+    *value = (quotient << k) | remainder;
+    return 0;
+}
+
+/* Decodes the block at offset into out, which has room for it, moving
+   offset past it. Returns -1, having said why, if it isn't valid. */
+static int decode_rice_block(const uint8_t* data, size_t size, size_t* offset,
+                             uint32_t num_channels, uint32_t block_frames, uint32_t* history,
+                             int32_t* out) {
+    const uint8_t* params = data + *offset + 4;
+    bit_reader reader;
+
+    reader.data = data;
+    reader.size = size;
+    reader.used = *offset + 4 + 2 * (size_t)num_channels;
+    reader.bits = 0;
+    reader.count = 0;
+
+    for(uint32_t c = 0; c < num_channels; ++c) {
+        int order = params[2 * c], k = params[2 * c + 1];
+        uint32_t last = history[2 * c], before = history[2 * c + 1];
+
+        if(order > RICE_MAX_ORDER || k > 31) {
+            fprintf(stderr, "Compressed block at byte %zu has a bad order or parameter.\n",
+                    *offset);
+            return -1;
+        }
+        for(uint32_t i = 0; i < block_frames; ++i) {
+            uint32_t value, sample;
+
+            if(get_rice(&reader, k, &value) != 0) {
+                fprintf(stderr, "Compressed render is cut short.\n");
+                return -1;
+            }
+            sample = unzigzag(value) + predict(order, last, before);
+            out[(size_t)i * num_channels + c] = (int32_t)sample;
+            before = last;
+            last = sample;
+        }
+        history[2 * c] = last;
+        history[2 * c + 1] = before;
+    }
+
+    *offset = reader.used;
+    return 0;
+}
+
+int decode_rice(const uint8_t* data, size_t size, int32_t** samples, uint64_t* frames,
+                int* channels) {
+    uint32_t* history;
+    int32_t* out = NULL;
+    uint64_t used_frames = 0, capacity = 0;
+    size_t offset = RICE_HEADER_SIZE;
+    uint32_t num_channels;
+    int ret = 0;
+
+    if(size < RICE_HEADER_SIZE || memcmp(data, "TSRICE", 6) != 0 || data[6] != RICE_VERSION) {
+        fprintf(stderr, "Not a version %d compressed render.\n", RICE_VERSION);
+        return -1;
+    }
+    num_channels = get_le32(data + 12);
+    if(num_channels < 1 || num_channels > 65535) {
+        fprintf(stderr, "Compressed render has %u channels.\n", num_channels);
+        return -1;
+    }
+    history = calloc(sizeof(uint32_t), 2 * (size_t)num_channels);
+
+    while(offset < size && ret == 0) {
+        uint32_t block_frames;
+
+        if(size - offset < 4 + 2 * (size_t)num_channels) {
+            fprintf(stderr, "Compressed render is cut short.\n");
+            ret = -1;
+            break;
+        }
+        block_frames = get_le32(data + offset);
+        if(block_frames < 1 || block_frames > RICE_BLOCK_FRAMES) {
+            fprintf(stderr, "Compressed block at byte %zu has %u frames.\n", offset, block_frames);
+            ret = -1;
+            break;
+        }
+
+        if(used_frames + block_frames > capacity) {
+            capacity = (used_frames + block_frames) * 2;
+            out = realloc(out, capacity * num_channels * sizeof(*out));
+        }
+        ret = decode_rice_block(data, size, &offset, num_channels, block_frames, history,
+                                out + used_frames * num_channels);
+        used_frames += block_frames;
+    }
+
+    free(history);
+    if(ret != 0) {
+        free(out);
+        return -1;
+    }
+    *samples = out;
+    *frames = used_frames;
+    *channels = (int)num_channels;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sample encoders the output sink runs as it writes, so converting or
+   compressing a render costs no pass of its own. The mix is full scale
+   32 bit, so 16 bit output keeps the top 16 bits and float output maps
+   INT32_MIN to -1.0.
+
+   The conversions have SSE2 and AVX2 kernels, picked with the voice bank's
+   kernel (see select_voice_kernel), and every kernel gives bit identical
+   output. */
+
+/* 16 bit output is dithered with triangular noise of up to one output step
+   either way, the sum of two uniform 16 bit values taken from one of
+   DITHER_STREAMS xorshift32 generators. Sample i of the output draws from
+   generator i % DITHER_STREAMS, so a vector kernel steps a whole register of
+   generators at once and still produces exactly the scalar sequence. */
+#define DITHER_STREAMS 8
+
+typedef struct _dither_state {
+    uint32_t streams[DITHER_STREAMS];
+    uint64_t position; /* samples dithered so far */
+} dither_state;
+
+/* Seeds the generators. The same seed always gives the same output. */
+void init_dither(dither_state* dither, uint32_t seed);
+
+/* Converts count samples to dithered 16 bit, saturating at the ends of the
+   range. */
+void encode_s16(dither_state* dither, int16_t* out, const int32_t* in, size_t count);
+
+/* Converts count samples to float. Nothing is lost that float can hold,
+   and its 24 bit mantissa puts rounding far below anything dither would
+   mask, so none is added. */
+void encode_f32(float* out, const int32_t* in, size_t count);
+
+/* The compressed format, a header then a stream of blocks, each decodable
+   only after the ones before it, laid out in binformat.txt. Each block
+   codes up to RICE_BLOCK_FRAMES frames. Every channel of a block is
+   predicted from its previous samples with a fixed polynomial of order 0,
+   1 or 2, whichever leaves the smallest residuals. The residuals are
+   zigzag mapped to unsigned and Rice coded with a parameter chosen for the
+   block. Prediction history carries on from block to block, which is why
+   blocks can't be decoded on their own. Decoding gives back the 32 bit
+   samples exactly. */
+#define RICE_HEADER_SIZE 16
+#define RICE_BLOCK_FRAMES 4096
+#define RICE_MAX_ORDER 2
+
+typedef struct _rice_encoder {
+    int channels;
+    uint32_t* history; /* last two samples of each channel, newest first */
+    uint32_t* residuals; /* one block's worth of one channel */
+} rice_encoder;
+
+rice_encoder* create_rice_encoder(int channels);
+void free_rice_encoder(rice_encoder* encoder);
+
+void make_rice_header(uint8_t* header, int channels);
+
+/* Most bytes a block of frames frames can take. */
+size_t rice_block_bound(int channels, size_t frames);
+
+/* Codes frames interleaved frames, at most RICE_BLOCK_FRAMES, as one block
+   into out, which must hold rice_block_bound bytes. Returns the bytes
+   used. */
+size_t encode_rice_block(rice_encoder* encoder, uint8_t* out, const int32_t* samples,
+                         size_t frames);
+
+/* Decodes a whole compressed stream of size bytes. On success returns 0,
+   with *samples a malloced buffer of *frames interleaved frames of
+   *channels samples. Returns -1 and says why on stderr if the data isn't a
+   valid stream. */
+int decode_rice(const uint8_t* data, size_t size, int32_t** samples, uint64_t* frames,
+                int* channels);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "fixedpoint.h"
+#include "wavetable.h"
+
+/* pi / 2 in Q30. */
+#define FIXED_HALF_PI 1686629713
+
+static int32_t fixed_sine_table[FIXED_SINE_SIZE + 1];
+
+static int fixed_tables_ready = 0;
+
+/* value / 2^bits, rounded half away from zero. Shifts are only ever done on
+   unsigned values, where C defines them exactly. */
+static inline int64_t shift_round(int64_t value, int bits) {
+    uint64_t half = (uint64_t)1 << (bits - 1);
+
+    if(value < 0) {
+        return -(int64_t)(((uint64_t)0 - (uint64_t)value + half) >> bits);
+    }
+    return (int64_t)(((uint64_t)value + half) >> bits);
+}
+
+/* sin(x) for x in [0, pi / 2], both in Q30, by summing the Taylor series
+   until its terms vanish. All the terms are positive, so they're worked out
+   unsigned. */
+static int32_t quarter_sine(uint64_t x) {
+    uint64_t x2 = (x * x) >> 30;
+    uint64_t term = x;
+    int64_t sum = (int64_t)x;
+
+    for(uint64_t k = 1; term != 0; ++k) {
+        term = ((term * x2) >> 30) / ((2 * k) * (2 * k + 1));
+        sum += (k & 1) ? -(int64_t)term : (int64_t)term;
+    }
+    return sum > FIXED_ONE ? FIXED_ONE : (int32_t)sum;
+}
+
+void init_fixed_tables(void) {
+    const int32_t quarter = FIXED_SINE_SIZE / 4;
+    int32_t quarter_table[FIXED_SINE_SIZE / 4 + 1];
+
+    if(fixed_tables_ready) {
+        return;
+    }
+
+    for(int32_t i = 0; i <= quarter; ++i) {
+        quarter_table[i] = quarter_sine(((uint64_t)i * FIXED_HALF_PI + quarter / 2) / quarter);
+    }
+    for(int32_t i = 0; i < FIXED_SINE_SIZE; ++i) {
+        int32_t r = i % quarter;
+        switch(i / quarter) {
+        case 0: fixed_sine_table[i] = quarter_table[r]; break;
+        case 1: fixed_sine_table[i] = quarter_table[quarter - r]; break;
+        case 2: fixed_sine_table[i] = -quarter_table[r]; break;
+        default: fixed_sine_table[i] = -quarter_table[quarter - r]; break;
+        }
+    }
+    fixed_sine_table[FIXED_SINE_SIZE] = fixed_sine_table[0];
+    fixed_tables_ready = 1;
+}
+
+/* sin(2 pi phase / 2^32) in Q30. */
+static inline int32_t fixed_sine(uint32_t phase) {
+    uint32_t index = phase >> FIXED_SINE_FRAC_BITS;
+    int64_t frac = phase & ((1u << FIXED_SINE_FRAC_BITS) - 1);
+    int32_t a = fixed_sine_table[index];
+    int32_t b = fixed_sine_table[index + 1];
+
+    return a + (int32_t)shift_round((b - a) * frac, FIXED_SINE_FRAC_BITS);
+}
+
+/* A Q30 value times gain, as an output sample. */
+static inline int32_t scale_fixed(int32_t value, int32_t gain) {
+    return (int32_t)shift_round((int64_t)value * gain, 30);
+}
+
+int32_t generate_next_fixed_sample(oscillator* osc, int32_t gain) {
+    int32_t sample;
+    generate_fixed_osc_samples(osc, gain, &sample, 1);
+    return sample;
+}
+
+void generate_fixed_osc_samples(oscillator* osc, int32_t gain, int32_t* out, int32_t n) {
+    uint32_t phase = osc->phase;
+    uint32_t step = phase_increment(osc->frequency);
+    int32_t i;
+
+    switch(osc->type) {
+    case SQUARE:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = phase > (UINT32_MAX / 2) ? gain : -gain;
+        }
+        break;
+
+    case SAWTOOTH:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = (int32_t)shift_round((int64_t)centred_phase(phase) * gain, 32);
+        }
+        break;
+
+    case TRIANGLE:
+        for(i = 0; i < n; ++i) {
+            /* Distance from half a cycle, 0 to 2^31, so 2^30 is the middle. */
+            uint32_t centred;
+            phase += step;
+            centred = (uint32_t)centred_phase(phase);
+            if(centred >= 0x80000000u) {
+                centred = 0u - centred;
+            }
+            out[i] = scale_fixed((int32_t)((int64_t)centred - FIXED_ONE), gain);
+        }
+        break;
+
+    case SINE:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = scale_fixed(fixed_sine(phase), gain);
+        }
+        break;
+
+    case FM:
+    {
+        uint32_t fm_phase = osc->fm_phase;
+        uint32_t fm_step = phase_increment(osc->fm_freq);
+
+        for(i = 0; i < n; ++i) {
+            fm_phase += fm_step;
+            phase += phase_increment(scale_fixed(fixed_sine(fm_phase), osc->fm_gain) + osc->frequency);
+            out[i] = scale_fixed(fixed_sine(phase), gain);
+        }
+        osc->fm_phase = fm_phase;
+    }
+    break;
+
+    default:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = 0;
+        }
+        break;
+    };
+
+    osc->phase = phase;
+}
@@ -0,0 +1,39 @@
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include <stdint.h>
+
+#include "tinysynth.h"
+
+/* The fixed point engine works entirely in integers, so its output is the
+   same on every compiler and architecture, FPU or not. Sines come from a
+   table of Q30 values (1.0 == 1 << 30) indexed by the top FIXED_SINE_BITS
+   of the phase and linearly interpolated on the rest. The table itself is
+   built with integer arithmetic rather than taken from libm. */
+#define FIXED_SINE_BITS 12
+#define FIXED_SINE_SIZE (1 << FIXED_SINE_BITS)
+#define FIXED_SINE_FRAC_BITS (32 - FIXED_SINE_BITS)
+#define FIXED_ONE (1 << 30)
+
+/* Fills in the sine table. Safe to call more than once; create_output_state
+   does so for every output state. */
+void init_fixed_tables(void);
+
+/* Drop in replacement for generate_next_osc_sample. Every result is rounded
+   half away from zero, as the libm engine rounds. Against the libm engine,
+   for any gain in gaintable, output differs by at most:
+     square      0
+     saw         2^-24 of |gain| + 1
+     triangle    2^-22 of |gain| + 1
+     sine        2^-20 of |gain| + 1
+   most of which is the libm engine's own single precision rounding. As with
+   the table engine, the libm triangle's overflow at a phase of 0xffffffff
+   isn't reproduced, and FM output drifts from the libm engine's over a long
+   note. The interpolate setting makes no difference. */
+int32_t generate_next_fixed_sample(oscillator* osc, int32_t gain);
+
+/* Generates n consecutive samples of one oscillator into out, bit identical
+   to n calls of generate_next_fixed_sample. */
+void generate_fixed_osc_samples(oscillator* osc, int32_t gain, int32_t* out, int32_t n);
+
+#endif
@@ -0,0 +1,697 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tinysynth.h"
+#include "sink.h"
+#include "voicebank.h"
+#include "parallel.h"
+#include "sectioncache.h"
+#include "composition.h"
+#include "stream.h"
+#include "batch.h"
+#include "trace.h"
+#include "seek.h"
+#include "encode.h"
+#include "daemon.h"
+
+/* Samples rendered per call to render_block. */
+#define RENDER_BLOCK_SIZE 4096
+
+/* Default section cache size, in MiB. */
+#define DEFAULT_CACHE_MB 64
+
+/* Defaults for real-time streaming, in samples: about 12ms blocks and 93ms
+   of buffering. */
+#define DEFAULT_STREAM_BLOCK 512
+#define DEFAULT_STREAM_BUFFER 4096
+
+static void print_usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-f raw|wav] [-F s32|s16|f32|rice] [-o output] [-n] [-m]\n"
+            "          [-e libm|table|fixed] [-i]\n"
+            "          [-k auto|scalar|sse2|avx2] [-j threads] [-c MiB]\n"
+            "          [-r] [-b samples] [-q samples] [-s sample] [-t samples]\n"
+            "          [-x files|channels] [-T report] composition\n"
+            "       %s [options] [-l list] [-d directory] composition|directory ...\n"
+            "       %s -U [-f raw|wav] [-F s32|s16|f32] [-o output] render.tsr\n"
+            "       %s -S socket [-f raw|wav] [-F s32|s16|f32|rice] [-e libm|table|fixed]\n"
+            "          [-i] [-k auto|scalar|sse2|avx2] [-j threads] [-c MiB] [-T report]\n"
+            "  -f  output container, raw (default) or wav\n"
+            "  -F  sample format, s32 (default), s16 with dither, f32, or rice for\n"
+            "      lossless compression (raw container only)\n"
+            "  -o  output file, or - for stdout (default sound with the format's\n"
+            "      extension, as sound.s32, or sound.wav)\n"
+            "  -n  discard the output instead of writing it anywhere\n"
+            "  -m  write through a memory mapped, pre-sized output file\n"
+            "  -e  oscillator engine, libm (default), table or fixed (integer only)\n"
+            "  -i  interpolate between wavetable entries\n"
+            "  -k  vector kernel for the table engine and format conversion\n"
+            "      (default auto)\n"
+            "  -j  render play order entries on this many threads, 0 for one per CPU\n"
+            "      (default 1, streaming as it renders, or one per CPU in batch mode)\n"
+            "  -c  memory for caching repeated sections, 0 to turn off (default %d)\n"
+            "  -r  play in real time through a render thread, reporting underruns\n"
+            "  -b  samples per block when playing in real time (default %d)\n"
+            "  -q  samples of buffering when playing in real time (default %d)\n"
+            "  -s  start rendering, or playing with -r, from this sample\n"
+            "  -t  render only this many samples (default to the end)\n"
+            "  -x  also write every instrument's stem, rendered in the same pass as\n"
+            "      the mix: as files named after the output with .stemN before the\n"
+            "      extension, or as channels of the output after the mix\n"
+            "  -T  write render counters and recent note events as JSON to this file,\n"
+            "      or - for stderr\n"
+            "Batch mode renders many compositions at once. It is used for more than one\n"
+            "input, a directory of .cmp files, or with -l or -d:\n"
+            "  -l  file listing compositions, one per line, each optionally followed by\n"
+            "      a tab and its output file; - for stdin\n"
+            "  -d  directory for outputs not named in the list (default next to each\n"
+            "      composition), each named after its composition\n"
+            "  -U  unpack a compressed render into the output instead of rendering\n"
+            "  -S  serve render requests on this Unix socket until interrupted, keeping\n"
+            "      loaded compositions and rendered sections in a cache of -c MiB; -j\n"
+            "      sets the workers (default one per CPU), and -f and -F the format of\n"
+            "      renders written to files. Requests are lines of tab separated fields:\n"
+            "        render <composition> [<output>]\n"
+            "        range <composition> <start> <length> [<output>]\n"
+            "        stats\n",
+            name, name, name, name, DEFAULT_CACHE_MB, DEFAULT_STREAM_BLOCK, DEFAULT_STREAM_BUFFER);
+}
+
+/* Decodes a compressed render into the sink's format. */
+static int unpack_render(const char* input_name, const char* output_name,
+                         sink_container container, sink_format format) {
+    FILE* infile = fopen(input_name, "rb");
+    uint8_t* data = NULL;
+    size_t size = 0, capacity = 0, got;
+    int32_t* samples;
+    uint64_t frames;
+    int channels;
+    output_sink* sink;
+    int ret;
+
+    if(infile == NULL) {
+        perror(input_name);
+        return -1;
+    }
+    do {
+        if(size == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1 << 20;
+            data = realloc(data, capacity);
+        }
+        got = fread(data + size, 1, capacity - size, infile);
+        size += got;
+    } while(got > 0);
+    fclose(infile);
+
+    ret = decode_rice(data, size, &samples, &frames, &channels);
+    free(data);
+    if(ret != 0) {
+        return -1;
+    }
+
+    sink = open_sink(output_name, container, format, channels, 0, frames);
+    if(sink == NULL) {
+        free(samples);
+        return -1;
+    }
+    ret = sink_write(sink, samples, frames);
+    if(close_sink(sink) != 0) {
+        ret = -1;
+    }
+    free(samples);
+    return ret;
+}
+
+/* Renders the whole composition in fixed size blocks, writing each as it
+   goes. */
+static int render_streaming(output_state* os, composition* comp, output_sink* sink) {
+    int32_t block[RENDER_BLOCK_SIZE];
+    size_t frames;
+
+    setup_output_state_for_composition(os, comp);
+
+    while((frames = render_block(os, comp, block, RENDER_BLOCK_SIZE)) > 0) {
+        if(sink_write(sink, block, frames) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Puts os at sample start of the composition, seeking straight there
+   rather than rendering everything before it. */
+static int start_output_state(output_state* os, composition* comp, uint64_t start) {
+    sample_index* index;
+    int ret;
+
+    if(start == 0) {
+        setup_output_state_for_composition(os, comp);
+        return 0;
+    }
+    index = build_sample_index(comp, os);
+    ret = seek_output_state(os, index, start);
+    free_sample_index(index);
+    return ret;
+}
+
+/* Renders length samples from start on, in fixed size blocks. */
+static int render_range(output_state* os, composition* comp, uint64_t start, uint64_t length,
+                        output_sink* sink) {
+    int32_t block[RENDER_BLOCK_SIZE];
+    int ret = start_output_state(os, comp, start);
+
+    while(ret == 0 && length > 0) {
+        size_t frames = render_block(os, comp, block,
+                                     length < RENDER_BLOCK_SIZE ? length : RENDER_BLOCK_SIZE);
+        if(frames == 0) {
+            break;
+        }
+        ret = sink_write(sink, block, frames);
+        length -= frames;
+    }
+    return ret;
+}
+
+/* How -x writes stems. */
+#define STEMS_NONE 0
+#define STEMS_FILES 1
+#define STEMS_CHANNELS 2
+
+/* Names stem i's file after the output, as sound.stem0.s32 for sound.s32. */
+static char* stem_file_name(const char* output_name, int32_t stem) {
+    const char* slash = strrchr(output_name, '/');
+    const char* dot = strrchr(output_name, '.');
+    size_t base = dot != NULL && (slash == NULL || dot > slash) ? (size_t)(dot - output_name)
+                                                                 : strlen(output_name);
+    size_t size = strlen(output_name) + 32;
+    char* name = malloc(size);
+
+    snprintf(name, size, "%.*s.stem%d%s", (int)base, output_name, stem, output_name + base);
+    return name;
+}
+
+/* Renders length samples from start on, with every oscillator's stem
+   alongside the mix, in one pass. With STEMS_CHANNELS the mix and stems are
+   interleaved into sink's frames, mix first; with STEMS_FILES the mix goes
+   to sink and stem i to stem_sinks[i]. */
+static int render_stems(output_state* os, composition* comp, uint64_t start, uint64_t length,
+                        int stem_mode, output_sink* sink, output_sink** stem_sinks) {
+    int32_t num_stems = os->num_oscillators;
+    int32_t channels = num_stems + 1;
+    int32_t block[RENDER_BLOCK_SIZE];
+    int32_t* stem_samples = malloc((size_t)num_stems * RENDER_BLOCK_SIZE * sizeof(int32_t));
+    int32_t** stems = malloc(num_stems * sizeof(*stems));
+    int32_t* frames_out = NULL;
+    int ret = start_output_state(os, comp, start);
+
+    for(int32_t i = 0; i < num_stems; ++i) {
+        stems[i] = stem_samples + (size_t)i * RENDER_BLOCK_SIZE;
+    }
+    if(stem_mode == STEMS_CHANNELS) {
+        frames_out = malloc((size_t)channels * RENDER_BLOCK_SIZE * sizeof(int32_t));
+    }
+
+    while(ret == 0 && length > 0) {
+        size_t frames = render_block_stems(os, comp, block, stems,
+                                           length < RENDER_BLOCK_SIZE ? length : RENDER_BLOCK_SIZE);
+        if(frames == 0) {
+            break;
+        }
+
+        if(stem_mode == STEMS_CHANNELS) {
+            for(size_t x = 0; x < frames; ++x) {
+                frames_out[x * channels] = block[x];
+                for(int32_t i = 0; i < num_stems; ++i) {
+                    frames_out[x * channels + 1 + i] = stems[i][x];
+                }
+            }
+            ret = sink_write(sink, frames_out, frames);
+        } else {
+            ret = sink_write(sink, block, frames);
+            for(int32_t i = 0; i < num_stems && ret == 0; ++i) {
+                ret = sink_write(stem_sinks[i], stems[i], frames);
+            }
+        }
+        length -= frames;
+    }
+
+    free(frames_out);
+    free(stems);
+    free(stem_samples);
+    return ret;
+}
+
+/* Renders one play order entry at a time so repeated sections can come from
+   the cache. Needs a buffer as long as the longest section. */
+static int render_by_entry(output_state* os, composition* comp, section_cache* cache,
+                           output_sink* sink) {
+    uint64_t longest = 0;
+    int32_t* buffer;
+    int ret = 0;
+
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        uint64_t length = play_order_entry_length(comp, i);
+        longest = length > longest ? length : longest;
+    }
+    buffer = malloc(longest * sizeof(*buffer) + 1);
+
+    setup_output_state_for_composition(os, comp);
+    for(int32_t i = 0; i < comp->num_play_order && ret == 0; ++i) {
+        render_play_order_entry(os, comp, cache, buffer);
+        ret = sink_write(sink, buffer, play_order_entry_length(comp, i));
+    }
+
+    free(buffer);
+    return ret;
+}
+
+/* Plays the composition in real time and reports how well rendering kept
+   up. */
+static int render_in_real_time(output_state* os, composition* comp,
+                               const stream_options* options, output_sink* sink) {
+    stream_stats stats;
+    int ret = stream_composition(os, comp, sink, options, &stats);
+
+    fprintf(stderr, "Streamed %llu blocks of %zu samples (%.2fms) through a %zu sample buffer"
+            " (%.2fms): %llu underruns, %llu deadline misses, slowest block took %.2fms.\n",
+            (unsigned long long)stats.blocks_played, options->block_size, stats.block_ns / 1e6,
+            stats.buffer_size, stats.buffer_size * 1e3 / sample_rate,
+            (unsigned long long)stats.underruns, (unsigned long long)stats.deadline_misses,
+            stats.worst_render_ns / 1e6);
+    return ret;
+}
+
+/* Renders every composition named on the command line or in the list file
+   on one pool of threads. */
+static int render_batch_mode(int num_inputs, char** inputs, const char* list_name,
+                             const char* output_dir, const batch_options* options) {
+    batch_list list;
+    batch_stats stats;
+    int ret = 0;
+
+    memset(&list, 0, sizeof(list));
+    if(list_name != NULL) {
+        ret = add_batch_list_file(&list, list_name, output_dir,
+                                  sink_extension(options->container, options->format));
+    }
+    for(int i = 0; i < num_inputs && ret == 0; ++i) {
+        struct stat st;
+        if(stat(inputs[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            ret = add_batch_directory(&list, inputs[i], output_dir,
+                                      sink_extension(options->container, options->format));
+        } else {
+            add_batch_job(&list, inputs[i], NULL, output_dir,
+                          sink_extension(options->container, options->format));
+        }
+    }
+
+    if(ret == 0) {
+        ret = render_batch(&list, options, &stats);
+        fprintf(stderr, "Batch: %d of %d files rendered (%llu samples) on %d threads,"
+                " %llu tasks of which %llu stolen, %llu repeated entries reused.\n",
+                (int)stats.files_rendered, (int)list.num_jobs, (unsigned long long)stats.samples,
+                stats.num_threads, (unsigned long long)stats.tasks,
+                (unsigned long long)stats.tasks_stolen, (unsigned long long)stats.repeats_reused);
+    }
+
+    free_batch_list(&list);
+    return ret;
+}
+
+/* Renders the whole composition into memory across threads, then writes it
+   out in one go. */
+static int render_in_parallel(output_state* os, composition* comp, section_cache* cache,
+                              int num_threads, output_sink* sink) {
+    uint64_t length = composition_length(comp);
+    int32_t* rendered = malloc(length * sizeof(*rendered) + 1);
+    int ret;
+
+    if(rendered == NULL) {
+        fprintf(stderr, "Couldn't allocate %llu samples to render into.\n",
+                (unsigned long long)length);
+        return -1;
+    }
+    render_composition_parallel(comp, os, rendered, num_threads, cache);
+    ret = sink_write(sink, rendered, length);
+    free(rendered);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    sink_container container = SINK_RAW;
+    sink_format format = SINK_S32;
+    char default_name[32];
+    int unpack = 0;
+    const char* output_name = NULL;
+    int use_mmap = 0;
+    osc_engine engine = ENGINE_LIBM;
+    int interpolate = 0;
+    voice_kernel kernel = VOICE_KERNEL_AUTO;
+    int num_threads = 1;
+    size_t cache_mb = DEFAULT_CACHE_MB;
+    int discard = 0;
+    int real_time = 0;
+    stream_options stream = {DEFAULT_STREAM_BLOCK, DEFAULT_STREAM_BUFFER, 0};
+    uint64_t range_length = UINT64_MAX;
+    int stem_mode = STEMS_NONE;
+    const char* list_name = NULL;
+    const char* output_dir = NULL;
+    int threads_given = 0;
+    const char* trace_name = NULL;
+    const char* socket_path = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "f:F:o:nme:ik:j:c:rb:q:l:d:s:t:x:UT:S:")) != -1) {
+        switch(opt) {
+        case 'f':
+            if(strcmp(optarg, "raw") == 0) {
+                container = SINK_RAW;
+            } else if(strcmp(optarg, "wav") == 0) {
+                container = SINK_WAV;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'F':
+            if(strcmp(optarg, "s32") == 0) {
+                format = SINK_S32;
+            } else if(strcmp(optarg, "s16") == 0) {
+                format = SINK_S16;
+            } else if(strcmp(optarg, "f32") == 0) {
+                format = SINK_F32;
+            } else if(strcmp(optarg, "rice") == 0) {
+                format = SINK_RICE;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'n':
+            discard = 1;
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'e':
+            if(strcmp(optarg, "libm") == 0) {
+                engine = ENGINE_LIBM;
+            } else if(strcmp(optarg, "table") == 0) {
+                engine = ENGINE_TABLE;
+            } else if(strcmp(optarg, "fixed") == 0) {
+                engine = ENGINE_FIXED;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'i':
+            interpolate = 1;
+            break;
+        case 'k':
+            if(strcmp(optarg, "auto") == 0) {
+                kernel = VOICE_KERNEL_AUTO;
+            } else if(strcmp(optarg, "scalar") == 0) {
+                kernel = VOICE_KERNEL_SCALAR;
+            } else if(strcmp(optarg, "sse2") == 0) {
+                kernel = VOICE_KERNEL_SSE2;
+            } else if(strcmp(optarg, "avx2") == 0) {
+                kernel = VOICE_KERNEL_AVX2;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            threads_given = 1;
+            break;
+        case 'c':
+            cache_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            real_time = 1;
+            break;
+        case 'b':
+            stream.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            stream.buffer_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            list_name = optarg;
+            break;
+        case 'd':
+            output_dir = optarg;
+            break;
+        case 's':
+            stream.start = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            range_length = strtoull(optarg, NULL, 10);
+            break;
+        case 'x':
+            if(strcmp(optarg, "files") == 0) {
+                stem_mode = STEMS_FILES;
+            } else if(strcmp(optarg, "channels") == 0) {
+                stem_mode = STEMS_CHANNELS;
+            } else {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'U':
+            unpack = 1;
+            break;
+        case 'T':
+            trace_name = optarg;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if(socket_path != NULL && (argc - optind > 0 || output_name != NULL || discard || use_mmap
+                               || real_time || stream.start > 0 || range_length != UINT64_MAX
+                               || stem_mode != STEMS_NONE || list_name != NULL
+                               || output_dir != NULL || unpack)) {
+        fprintf(stderr, "-S takes compositions and outputs from its requests.\n");
+        return -1;
+    }
+
+    struct stat input_stat;
+    int batch = list_name != NULL || output_dir != NULL || argc - optind > 1
+                || (argc - optind == 1 && stat(argv[optind], &input_stat) == 0
+                    && S_ISDIR(input_stat.st_mode));
+
+    if(!batch && socket_path == NULL && argc - optind != 1) {
+        fprintf(stderr, "Incorrect number of arguments.\n");
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    int ranged = stream.start > 0 || range_length != UINT64_MAX;
+
+    if(batch && (output_name != NULL || real_time || ranged || stem_mode != STEMS_NONE)) {
+        fprintf(stderr, "-o, -r, -s, -t and -x take a single composition, not a batch.\n");
+        return -1;
+    }
+
+    if(real_time && stem_mode != STEMS_NONE) {
+        fprintf(stderr, "-x can't be used when playing in real time.\n");
+        return -1;
+    }
+
+    if(real_time && range_length != UINT64_MAX) {
+        fprintf(stderr, "-t can't be used when playing in real time.\n");
+        return -1;
+    }
+
+    if(real_time && stream.block_size == 0) {
+        fprintf(stderr, "Blocks need at least one sample.\n");
+        return -1;
+    }
+
+    if(trace_name != NULL && enable_tracing() != 0) {
+        fprintf(stderr, "Built without tracing, rebuild with TRACE_FLAGS=-DTINYSYNTH_TRACE.\n");
+        trace_name = NULL;
+    }
+
+    if(container == SINK_WAV && format == SINK_RICE) {
+        fprintf(stderr, "Compressed output can't go in a WAV file.\n");
+        return -1;
+    }
+
+    if(output_name == NULL) {
+        snprintf(default_name, sizeof(default_name), "sound%s", sink_extension(container, format));
+        output_name = default_name;
+    }
+
+    /* Chosen before any threads start, as format conversion uses it too. */
+    kernel = select_voice_kernel(kernel);
+    if(engine == ENGINE_TABLE) {
+        fprintf(stderr, "Using the %s voice kernel.\n", voice_kernel_name(kernel));
+    }
+
+    if(unpack) {
+        if(batch || format == SINK_RICE) {
+            fprintf(stderr, "-U unpacks one compressed render into an uncompressed format.\n");
+            return -1;
+        }
+        return unpack_render(argv[optind], output_name, container, format) == 0 ? 0 : -1;
+    }
+
+    if(socket_path != NULL) {
+        daemon_options options;
+
+        memset(&options, 0, sizeof(options));
+        options.socket_path = socket_path;
+        options.num_threads = threads_given ? num_threads : 0;
+        options.engine = engine;
+        options.interpolate = interpolate;
+        options.cache_limit = cache_mb << 20;
+        options.container = container;
+        options.format = format;
+        int ret = serve_renders(&options);
+        if(trace_name != NULL && write_trace_report(trace_name) != 0) {
+            ret = -1;
+        }
+        return ret == 0 ? 0 : -1;
+    }
+
+    if(batch) {
+        batch_options options;
+
+        memset(&options, 0, sizeof(options));
+        options.num_threads = threads_given ? num_threads : 0;
+        options.engine = engine;
+        options.interpolate = interpolate;
+        options.reuse_repeats = cache_mb > 0;
+        options.container = container;
+        options.format = format;
+        options.use_mmap = use_mmap;
+        options.discard = discard;
+        int ret = render_batch_mode(argc - optind, argv + optind, list_name, output_dir,
+                                    &options);
+        if(trace_name != NULL && write_trace_report(trace_name) != 0) {
+            ret = -1;
+        }
+        return ret == 0 ? 0 : -1;
+    }
+
+    fprintf(stderr, "Reading from file: %s\n", argv[optind]);
+
+    composition comp;
+    if(load_composition(argv[optind], &comp) != 0) {
+        return -1;
+    }
+
+    uint64_t length = composition_length(&comp);
+    if(stream.start > length) {
+        fprintf(stderr, "Can't start at sample %llu of a %llu sample composition.\n",
+                (unsigned long long)stream.start, (unsigned long long)length);
+        free_composition(&comp);
+        return -1;
+    }
+    if(range_length > length - stream.start) {
+        range_length = length - stream.start;
+    }
+
+    /* One oscillator for every instrument of the busiest section. */
+    int32_t num_voices = max_section_instruments(&comp);
+    int32_t num_stems = num_voices > 0 ? num_voices : 1;
+
+    if(stem_mode == STEMS_FILES && !discard && strcmp(output_name, "-") == 0) {
+        fprintf(stderr, "Stem files need an output file name, not stdout.\n");
+        free_composition(&comp);
+        return -1;
+    }
+
+    output_sink* sink = open_sink(discard ? NULL : output_name, container, format,
+                                  stem_mode == STEMS_CHANNELS ? num_stems + 1 : 1, use_mmap,
+                                  range_length);
+    if(sink == NULL) {
+        free_composition(&comp);
+        return -1;
+    }
+
+    output_sink** stem_sinks = NULL;
+    if(stem_mode == STEMS_FILES) {
+        stem_sinks = calloc(sizeof(output_sink*), num_stems);
+        for(int32_t i = 0; i < num_stems; ++i) {
+            char* name = discard ? NULL : stem_file_name(output_name, i);
+            stem_sinks[i] = open_sink(name, container, format, 1, use_mmap, range_length);
+            free(name);
+            if(stem_sinks[i] == NULL) {
+                while(--i >= 0) {
+                    close_sink(stem_sinks[i]);
+                }
+                free(stem_sinks);
+                close_sink(sink);
+                free_composition(&comp);
+                return -1;
+            }
+        }
+    }
+
+    output_state* os = create_output_state(num_voices > 0 ? num_voices : 1);
+    os->engine = engine;
+    os->interpolate = interpolate;
+
+    section_cache* cache = NULL;
+    int ret;
+
+    if(cache_mb > 0 && !real_time && !ranged && stem_mode == STEMS_NONE) {
+        cache = create_section_cache(&comp, cache_mb << 20);
+    }
+
+    if(real_time) {
+        ret = render_in_real_time(os, &comp, &stream, sink);
+    } else if(stem_mode != STEMS_NONE) {
+        ret = render_stems(os, &comp, stream.start, range_length, stem_mode, sink, stem_sinks);
+    } else if(ranged) {
+        ret = render_range(os, &comp, stream.start, range_length, sink);
+    } else if(num_threads != 1) {
+        ret = render_in_parallel(os, &comp, cache, num_threads, sink);
+    } else if(cache != NULL) {
+        ret = render_by_entry(os, &comp, cache, sink);
+    } else {
+        ret = render_streaming(os, &comp, sink);
+    }
+
+    if(cache != NULL) {
+        fprintf(stderr, "Section cache: %llu hits, %llu misses, %llu bytes.\n",
+                (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+                (unsigned long long)cache->memory_used);
+        free_section_cache(cache);
+    }
+
+    if(close_sink(sink) != 0) {
+        ret = -1;
+    }
+    for(int32_t i = 0; stem_sinks != NULL && i < num_stems; ++i) {
+        if(close_sink(stem_sinks[i]) != 0) {
+            ret = -1;
+        }
+    }
+    free(stem_sinks);
+    if(trace_name != NULL && write_trace_report(trace_name) != 0) {
+        ret = -1;
+    }
+    free_output_state(os);
+    free_composition(&comp);
+    return ret == 0 ? 0 : -1;
+}
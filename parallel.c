@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "voicebank.h"
+#include "sectioncache.h"
+#include "trace.h"
+
+typedef struct _render_pool {
+    composition* comp;
+    int32_t* out;
+    entry_job* jobs;
+    int32_t num_jobs;
+    int32_t next_job;
+    pthread_mutex_t lock;
+} render_pool;
+
+typedef struct _render_worker {
+    render_pool* pool;
+    output_state* os;
+    pthread_t thread;
+} render_worker;
+
+void render_entry_job(output_state* os, composition* comp, const entry_job* jobs,
+                      int32_t entry, int32_t* out) {
+    const entry_job* job = jobs + entry;
+
+    enter_play_order_entry(os, comp, entry, job->start);
+    render_block(os, comp, out + job->offset, job->length);
+}
+
+static void* render_worker_main(void* arg) {
+    render_worker* worker = arg;
+    render_pool* pool = worker->pool;
+
+    for(;;) {
+        int32_t entry;
+
+        pthread_mutex_lock(&pool->lock);
+        entry = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(entry >= pool->num_jobs) {
+            break;
+        }
+        if(pool->jobs[entry].copy_of < 0) {
+            render_entry_job(worker->os, pool->comp, pool->jobs, entry, pool->out);
+        } else if(TRACE_ON()) {
+            trace_play_order_entry(worker->os, pool->comp, entry);
+        }
+    }
+    return NULL;
+}
+
+entry_job* plan_entry_jobs(composition* comp, const output_state* prototype,
+                           section_cache* cache) {
+    entry_job* jobs = calloc(sizeof(entry_job), comp->num_play_order);
+    int32_t* first_entry = malloc(comp->num_sections * sizeof(*first_entry));
+    output_state* walker = create_output_state(prototype->num_oscillators);
+    uint64_t offset = 0;
+
+    for(int32_t i = 0; i < comp->num_sections; ++i) {
+        first_entry[i] = -1;
+    }
+
+    setup_output_state_for_composition(walker, comp);
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        int32_t section_index = comp->play_order[i];
+
+        jobs[i].offset = offset;
+        jobs[i].length = play_order_entry_length(comp, i);
+        jobs[i].start = malloc(walker->num_oscillators * sizeof(oscillator));
+        memcpy(jobs[i].start, walker->oscillators, walker->num_oscillators * sizeof(oscillator));
+        jobs[i].copy_of = -1;
+
+        if(cache != NULL) {
+            if(first_entry[section_index] >= 0) {
+                section_cache_entry first;
+                first.start = jobs[first_entry[section_index]].start;
+                if(section_cache_matches(&first, walker, comp->sections + section_index)) {
+                    jobs[i].copy_of = first_entry[section_index];
+                }
+            } else {
+                first_entry[section_index] = i;
+            }
+            if(jobs[i].copy_of >= 0) {
+                cache->hits++;
+            } else {
+                cache->misses++;
+            }
+        }
+
+        offset += jobs[i].length;
+        skip_play_order_entry(walker, comp);
+    }
+
+    free_output_state(walker);
+    free(first_entry);
+    return jobs;
+}
+
+void copy_repeated_entries(composition* comp, const entry_job* jobs, int32_t* out) {
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        const entry_job* job = jobs + i;
+        if(job->copy_of >= 0) {
+            memcpy(out + job->offset, out + jobs[job->copy_of].offset,
+                   job->length * sizeof(*out));
+        }
+    }
+}
+
+void free_entry_jobs(composition* comp, entry_job* jobs) {
+    if(jobs == NULL) {
+        return;
+    }
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        free(jobs[i].start);
+    }
+    free(jobs);
+}
+
+void render_composition_parallel(composition* comp, const output_state* prototype,
+                                 int32_t* out, int num_threads, section_cache* cache) {
+    render_pool pool;
+    render_worker* workers;
+    int started = 1;
+
+    if(num_threads <= 0) {
+        num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(num_threads > comp->num_play_order) {
+        num_threads = comp->num_play_order;
+    }
+    if(num_threads < 1) {
+        num_threads = 1;
+    }
+
+    pool.comp = comp;
+    pool.out = out;
+    pool.jobs = plan_entry_jobs(comp, prototype, cache);
+    pool.num_jobs = comp->num_play_order;
+    pool.next_job = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* Output states are made here rather than on the workers, and the voice
+       kernel chosen, so the one-time table setup never runs on two threads
+       at once. */
+    current_voice_kernel();
+    workers = calloc(sizeof(render_worker), num_threads);
+    for(int i = 0; i < num_threads; ++i) {
+        workers[i].pool = &pool;
+        workers[i].os = create_output_state(prototype->num_oscillators);
+        workers[i].os->engine = prototype->engine;
+        workers[i].os->interpolate = prototype->interpolate;
+    }
+
+    /* The calling thread is worker 0, so the render finishes even if no
+       other thread can be started. */
+    for(; started < num_threads; ++started) {
+        if(pthread_create(&workers[started].thread, NULL, render_worker_main, workers + started) != 0) {
+            fprintf(stderr, "Couldn't start render thread %d, carrying on with %d.\n",
+                    started, started);
+            break;
+        }
+    }
+    render_worker_main(workers);
+    for(int i = 1; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    copy_repeated_entries(comp, pool.jobs, out);
+
+    for(int i = 0; i < num_threads; ++i) {
+        free_output_state(workers[i].os);
+    }
+    free_entry_jobs(comp, pool.jobs);
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+}
@@ -0,0 +1,54 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+
+#include "tinysynth.h"
+#include "sectioncache.h"
+
+/* Renders the whole composition into out, which must hold
+   composition_length(comp) samples. Play order entries are handed out to
+   num_threads workers, each rendering with its own output state set up like
+   prototype (oscillator count, engine, interpolation). Every entry lands at
+   the offset its predecessors' lengths add up to, so out ends up exactly as
+   a single render_block pass would have left it. num_threads of 0 or less
+   means one per online CPU.
+   If cache isn't NULL, repeated entries are copied from the first render
+   within out instead of being rendered again, and counted in the cache's
+   hits and misses. Nothing is stored in the cache itself. */
+void render_composition_parallel(composition* comp, const output_state* prototype,
+                                 int32_t* out, int num_threads, section_cache* cache);
+
+/* The pieces render_composition_parallel is built from, for schedulers of
+   their own. Each play order entry is an independent job once its starting
+   oscillator state is known. */
+typedef struct _entry_job {
+    uint64_t offset;
+    uint64_t length;
+    oscillator* start; /* oscillator state at the start of the entry */
+    int32_t copy_of; /* earlier entry that renders identically, or -1 */
+} entry_job;
+
+/* Walks the play order once without rendering to find where each entry's
+   output goes and what state its oscillators start in, for output states
+   with prototype's oscillator count. With a cache, an entry that would
+   render the same as an earlier one is marked as a copy of it, to be taken
+   straight from the earlier entry's place in the output, so it costs no
+   cache memory; only the cache's hits and misses are touched. Returns one
+   job per play order entry. */
+entry_job* plan_entry_jobs(composition* comp, const output_state* prototype,
+                           section_cache* cache);
+
+/* Renders one entry into its place in out. os must have the oscillator
+   count the jobs were planned for; its engine settings are used as they
+   are. */
+void render_entry_job(output_state* os, composition* comp, const entry_job* jobs,
+                      int32_t entry, int32_t* out);
+
+/* Fills in the entries marked as copies, once every other entry has been
+   rendered. */
+void copy_repeated_entries(composition* comp, const entry_job* jobs, int32_t* out);
+
+void free_entry_jobs(composition* comp, entry_job* jobs);
+
+#endif
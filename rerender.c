@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rerender.h"
+#include "wavetable.h"
+#include "composition.h"
+
+/* What an instrument's oscillator holds between notes that matters to the
+   notes after it, for one version of its notes. */
+typedef struct _stroke_walk {
+    int32_t frequency;
+    uint32_t fm_freq;
+    uint32_t fm_phase;
+} stroke_walk;
+
+/* Everything needed to re-render one instrument. */
+typedef struct _instrument_rerender {
+    composition* comp;
+    int32_t instrument;
+    note** old_notes; /* per section, NULL where nothing was edited */
+    uint8_t** edited; /* per section, a flag per note, or NULL */
+    output_state* os; /* instrument + 1 oscillators, all but the last silent */
+    instrument* view_instruments;
+    note* rests;
+    int32_t* old_samples;
+    int32_t* new_samples;
+    uint64_t scratch_size;
+    rerender_stats* stats;
+} instrument_rerender;
+
+/* Plays note n on the walk as render_block would: a struck note retunes the
+   oscillator, and FM modulators run on while it sounds. */
+static void walk_note(stroke_walk* walk, const instrument* inst, const note* notes, int32_t n,
+                      uint32_t note_samples) {
+    if(n == 0 || notes[n].pitch != 255) {
+        walk->frequency = freqtable[notes[n].pitch];
+        if(inst->type == FM) {
+            walk->fm_freq = (walk->frequency / inst->fm_denominator) * inst->fm_numerator;
+        }
+    }
+    if(inst->type == FM && walk->frequency != 0) {
+        walk->fm_phase += phase_increment(walk->fm_freq) * note_samples;
+    }
+}
+
+/* Renders the instrument alone over notes [begin, end) of a section, which
+   must start and finish on a stroke boundary, from the given modulator
+   phase. The other instruments are swapped for rests and the notes are
+   sliced, so the render is a composition of its own; the last note's
+   release comes out the same because the real next note is struck. */
+static void render_instrument_notes(instrument_rerender* r, const section* sec, note* notes,
+                                    int32_t begin, int32_t end, uint32_t fm_phase, int32_t* out) {
+    int32_t i = r->instrument;
+    int32_t entry = 0;
+    section view;
+    composition view_comp;
+
+    for(int32_t j = 0; j < i; ++j) {
+        memset(r->view_instruments + j, 0, sizeof(instrument));
+        r->view_instruments[j].notes = r->rests;
+    }
+    r->view_instruments[i] = sec->instruments[i];
+    r->view_instruments[i].notes = notes + begin;
+
+    view.tempo = sec->tempo;
+    view.num_instruments = i + 1;
+    view.num_notes = end - begin;
+    view.instruments = r->view_instruments;
+
+    memset(&view_comp, 0, sizeof(view_comp));
+    view_comp.num_play_order = 1;
+    view_comp.play_order = &entry;
+    view_comp.num_sections = 1;
+    view_comp.sections = &view;
+
+    setup_output_state_for_composition(r->os, &view_comp);
+    r->os->oscillators[i].fm_phase = fm_phase;
+    render_block(r->os, &view_comp, out, (uint64_t)samples_per_note(sec) * view.num_notes);
+}
+
+/* Swaps the instrument's old contribution to notes [begin, end) of the entry
+   at offset for its new one. */
+static void rerender_span(instrument_rerender* r, const section* sec, int32_t section_index,
+                          int32_t begin, int32_t end, uint32_t old_fm_phase, uint32_t new_fm_phase,
+                          int32_t* render) {
+    note* new_notes = sec->instruments[r->instrument].notes;
+    note* old_notes = r->old_notes[section_index] != NULL ? r->old_notes[section_index] : new_notes;
+    uint64_t length = (uint64_t)samples_per_note(sec) * (end - begin);
+
+    if(length > r->scratch_size) {
+        free(r->old_samples);
+        free(r->new_samples);
+        r->old_samples = malloc(length * sizeof(int32_t));
+        r->new_samples = malloc(length * sizeof(int32_t));
+        r->scratch_size = length;
+    }
+
+    render_instrument_notes(r, sec, old_notes, begin, end, old_fm_phase, r->old_samples);
+    render_instrument_notes(r, sec, new_notes, begin, end, new_fm_phase, r->new_samples);
+
+    /* Unsigned, so the sum wraps just as the mix did. */
+    for(uint64_t x = 0; x < length; ++x) {
+        render[x] = (int32_t)((uint32_t)render[x] - (uint32_t)r->old_samples[x]
+                              + (uint32_t)r->new_samples[x]);
+    }
+
+    r->stats->spans++;
+    r->stats->samples += length;
+}
+
+/* Walks every entry of the play order for one instrument, old and new notes
+   side by side, and re-renders the runs of strokes that differ. A stroke
+   boundary here is a note struck in both versions, so both versions'
+   strokes line up with it. */
+static void rerender_instrument(instrument_rerender* r, int32_t* render) {
+    composition* comp = r->comp;
+    int32_t i = r->instrument;
+    stroke_walk old_walk, new_walk;
+    uint64_t offset = 0;
+
+    memset(&old_walk, 0, sizeof(old_walk));
+    memset(&new_walk, 0, sizeof(new_walk));
+
+    for(int32_t p = 0; p < comp->num_play_order; offset += play_order_entry_length(comp, p), ++p) {
+        int32_t s = comp->play_order[p];
+        section* sec = comp->sections + s;
+        instrument* inst;
+        note* new_notes;
+        note* old_notes;
+        uint32_t note_samples = samples_per_note(sec);
+        uint32_t span_old_fm = 0, span_new_fm = 0;
+        int32_t span_begin = -1;
+        int32_t begin, end;
+
+        /* Unedited, non-FM stretches leave nothing behind for later ones. */
+        if(i >= sec->num_instruments
+           || (r->edited[s] == NULL && sec->instruments[i].type != FM)) {
+            continue;
+        }
+
+        inst = sec->instruments + i;
+        new_notes = inst->notes;
+        old_notes = r->old_notes[s] != NULL ? r->old_notes[s] : new_notes;
+
+        for(begin = 0; begin < sec->num_notes; begin = end) {
+            uint32_t old_fm = old_walk.fm_phase;
+            uint32_t new_fm = new_walk.fm_phase;
+            int changed = old_fm != new_fm;
+
+            for(end = begin + 1; end < sec->num_notes; ++end) {
+                if(old_notes[end].pitch != 255 && new_notes[end].pitch != 255) {
+                    break;
+                }
+            }
+            for(int32_t n = begin; n < end; ++n) {
+                if(r->edited[s] != NULL && r->edited[s][n]) {
+                    changed = 1;
+                }
+                walk_note(&old_walk, inst, old_notes, n, note_samples);
+                walk_note(&new_walk, inst, new_notes, n, note_samples);
+            }
+
+            if(changed && span_begin < 0) {
+                span_begin = begin;
+                span_old_fm = old_fm;
+                span_new_fm = new_fm;
+            } else if(!changed && span_begin >= 0) {
+                rerender_span(r, sec, s, span_begin, begin, span_old_fm, span_new_fm,
+                              render + offset + (uint64_t)span_begin * note_samples);
+                span_begin = -1;
+            }
+        }
+        if(span_begin >= 0) {
+            rerender_span(r, sec, s, span_begin, sec->num_notes, span_old_fm, span_new_fm,
+                          render + offset + (uint64_t)span_begin * note_samples);
+        }
+    }
+}
+
+static int check_edit(composition* comp, const note_edit* edit) {
+    section* sec;
+    note current;
+
+    if(edit->section < 0 || edit->section >= comp->num_sections) {
+        fprintf(stderr, "Edit names section %d of %d.\n", edit->section, comp->num_sections);
+        return -1;
+    }
+    sec = comp->sections + edit->section;
+    if(edit->instrument < 0 || edit->instrument >= sec->num_instruments
+       || edit->note < 0 || edit->note >= sec->num_notes) {
+        fprintf(stderr, "Edit names instrument %d note %d of section %d, which has %d and %d.\n",
+                edit->instrument, edit->note, edit->section, sec->num_instruments, sec->num_notes);
+        return -1;
+    }
+    current = sec->instruments[edit->instrument].notes[edit->note];
+    if(edit->old.gain > 100 || current.gain > 100) {
+        fprintf(stderr, "Edit to section %d instrument %d note %d has a gain above 100.\n",
+                edit->section, edit->instrument, edit->note);
+        return -1;
+    }
+    if(edit->note == 0 && (edit->old.pitch == 255 || current.pitch == 255)) {
+        fprintf(stderr, "Edit to section %d instrument %d starts the section with a sustain.\n",
+                edit->section, edit->instrument);
+        return -1;
+    }
+    return 0;
+}
+
+int rerender_edits(composition* comp, const output_state* os, int32_t* render,
+                   const note_edit* edits, int32_t num_edits, rerender_stats* stats) {
+    int32_t num_instruments = max_section_instruments(comp);
+    int32_t max_notes = 0;
+    uint8_t* instrument_edited;
+    rerender_stats local_stats;
+    instrument_rerender r;
+
+    for(int32_t e = 0; e < num_edits; ++e) {
+        if(check_edit(comp, edits + e) != 0) {
+            return -1;
+        }
+    }
+    /* Instruments past the render's oscillators were never heard, so
+       edits to them change nothing. */
+    if(num_instruments > os->num_oscillators) {
+        num_instruments = os->num_oscillators;
+    }
+    for(int32_t s = 0; s < comp->num_sections; ++s) {
+        if(comp->sections[s].num_notes > max_notes) {
+            max_notes = comp->sections[s].num_notes;
+        }
+    }
+
+    memset(&local_stats, 0, sizeof(local_stats));
+    memset(&r, 0, sizeof(r));
+    r.comp = comp;
+    r.stats = stats != NULL ? stats : &local_stats;
+    memset(r.stats, 0, sizeof(*r.stats));
+    r.old_notes = calloc(sizeof(note*), comp->num_sections + 1);
+    r.edited = calloc(sizeof(uint8_t*), comp->num_sections + 1);
+    r.view_instruments = calloc(sizeof(instrument), num_instruments + 1);
+    r.rests = calloc(sizeof(note), max_notes + 1);
+
+    instrument_edited = calloc(1, num_instruments + 1);
+    for(int32_t e = 0; e < num_edits; ++e) {
+        if(edits[e].instrument < num_instruments) {
+            instrument_edited[edits[e].instrument] = 1;
+        }
+    }
+
+    for(int32_t i = 0; i < num_instruments; ++i) {
+        if(!instrument_edited[i]) {
+            continue;
+        }
+
+        /* Rebuild the old notes of every section the instrument was edited
+           in. Going backwards means a cell listed twice ends up with its
+           first listed old value. */
+        for(int32_t e = num_edits - 1; e >= 0; --e) {
+            const note_edit* edit = edits + e;
+            section* sec = comp->sections + edit->section;
+
+            if(edit->instrument != i) {
+                continue;
+            }
+            if(r.old_notes[edit->section] == NULL) {
+                r.old_notes[edit->section] = malloc(sec->num_notes * sizeof(note));
+                memcpy(r.old_notes[edit->section], sec->instruments[i].notes,
+                       sec->num_notes * sizeof(note));
+                r.edited[edit->section] = calloc(1, sec->num_notes);
+            }
+            r.old_notes[edit->section][edit->note] = edit->old;
+            r.edited[edit->section][edit->note] = 1;
+        }
+
+        r.instrument = i;
+        r.os = create_output_state(i + 1);
+        r.os->engine = os->engine;
+        r.os->interpolate = os->interpolate;
+
+        rerender_instrument(&r, render);
+
+        free_output_state(r.os);
+        for(int32_t s = 0; s < comp->num_sections; ++s) {
+            free(r.old_notes[s]);
+            free(r.edited[s]);
+            r.old_notes[s] = NULL;
+            r.edited[s] = NULL;
+        }
+    }
+
+    free(instrument_edited);
+    free(r.old_samples);
+    free(r.new_samples);
+    free(r.rests);
+    free(r.view_instruments);
+    free(r.edited);
+    free(r.old_notes);
+    return 0;
+}
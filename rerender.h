@@ -0,0 +1,45 @@
+#ifndef RERENDER_H
+#define RERENDER_H
+
+#include <stdint.h>
+
+#include "tinysynth.h"
+
+/* Incremental re-rendering, for hearing an edit without rendering the whole
+   composition again.
+
+   Each instrument plays on its own oscillator and the mix is a wrapping
+   sum, so a render is exactly the sum of every instrument's contribution.
+   An edited instrument's old contribution can be taken out of a render and
+   its new one added in, leaving every other instrument's samples alone. An
+   instrument's contribution falls into strokes: a struck note and the notes
+   sustained from it, which start from a fresh carrier phase and depend on
+   nothing before them but the FM modulator phase. Only strokes holding an
+   edited note are rendered again, plus, for FM instruments whose modulator
+   phase an edit has moved, the strokes after it, so the work done grows
+   with the size of the edit rather than the length of the composition. */
+
+typedef struct _note_edit {
+    int32_t section;
+    int32_t instrument;
+    int32_t note;
+    note old; /* what the cell held when the render was made */
+} note_edit;
+
+typedef struct _rerender_stats {
+    uint64_t spans;   /* runs of strokes rendered again */
+    uint64_t samples; /* samples of the render they covered */
+} rerender_stats;
+
+/* Brings render, a full render of the composition as it was before the
+   edits made with os's oscillator count and engine settings, up to date
+   with the composition as it is now. Each edited cell is listed once with its old value; comp
+   already holds the new ones. Only notes may have changed: tempos, note
+   counts, instrument types and FM settings must be as they were.
+   stats may be NULL. Returns 0 on success, or -1 without touching render if
+   an edit names a cell that doesn't exist, a gain above 100, or a sustain
+   on a section's first note. */
+int rerender_edits(composition* comp, const output_state* os, int32_t* render,
+                   const note_edit* edits, int32_t num_edits, rerender_stats* stats);
+
+#endif
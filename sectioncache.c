@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sectioncache.h"
+#include "trace.h"
+
+section_cache* create_section_cache(composition* comp, size_t memory_limit) {
+    section_cache* cache = calloc(sizeof(section_cache), 1);
+
+    cache->num_sections = comp->num_sections;
+    cache->entries = calloc(sizeof(section_cache_entry), comp->num_sections);
+    cache->memory_limit = memory_limit;
+    return cache;
+}
+
+void free_section_cache(section_cache* cache) {
+    if(cache == NULL) {
+        return;
+    }
+    for(int32_t i = 0; i < cache->num_sections; ++i) {
+        free(cache->entries[i].samples);
+        free(cache->entries[i].start);
+    }
+    free(cache->entries);
+    free(cache);
+}
+
+int section_cache_matches(const section_cache_entry* cached, const output_state* os,
+                          const section* sec) {
+    if(cached->start == NULL) {
+        return 0;
+    }
+    for(int32_t i = 0; i < os->num_oscillators && i < sec->num_instruments; ++i) {
+        if(sec->instruments[i].type == FM && cached->start[i].fm_phase != os->oscillators[i].fm_phase) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void render_play_order_entry(output_state* os, composition* comp,
+                             section_cache* cache, int32_t* out) {
+    int32_t section_index = comp->play_order[os->section_num];
+    section* sec = comp->sections + section_index;
+    uint64_t length = play_order_entry_length(comp, os->section_num);
+    section_cache_entry* cached = cache != NULL ? cache->entries + section_index : NULL;
+    oscillator* start = NULL;
+
+    if(cached != NULL && cached->samples != NULL && section_cache_matches(cached, os, sec)) {
+        cache->hits++;
+        memcpy(out, cached->samples, length * sizeof(*out));
+        if(TRACE_ON()) {
+            trace_play_order_entry(os, comp, os->section_num);
+        }
+        skip_play_order_entry(os, comp);
+        return;
+    }
+
+    if(cached != NULL) {
+        cache->misses++;
+        if(cached->start == NULL && cache->memory_used + length * sizeof(*out) <= cache->memory_limit) {
+            start = malloc(os->num_oscillators * sizeof(*start));
+            memcpy(start, os->oscillators, os->num_oscillators * sizeof(*start));
+        }
+    }
+
+    render_block(os, comp, out, length);
+    skip_play_order_entry(os, comp);
+
+    if(start != NULL) {
+        cached->samples = malloc(length * sizeof(*out));
+        memcpy(cached->samples, out, length * sizeof(*out));
+        cached->length = length;
+        cached->start = start;
+        cache->memory_used += length * sizeof(*out);
+    }
+}
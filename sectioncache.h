@@ -0,0 +1,48 @@
+#ifndef SECTIONCACHE_H
+#define SECTIONCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinysynth.h"
+
+/* Rendered sections, keyed by section index, so a play order that repeats a
+   section only renders it once. Every section starts with fresh carrier
+   phases, but FM modulator phases carry on from whatever played before, so
+   an entry only reuses a render if its FM voices start at the same
+   modulator phases too. Sections without FM instruments always match.
+
+   A cache holds renders from one engine configuration; don't share one
+   between output states set up differently. */
+typedef struct _section_cache_entry {
+    int32_t* samples; /* NULL until the section has been cached */
+    uint64_t length;
+    oscillator* start; /* oscillator state the render started from */
+} section_cache_entry;
+
+typedef struct _section_cache {
+    int32_t num_sections;
+    section_cache_entry* entries;
+    size_t memory_limit; /* bytes of samples the cache may hold */
+    size_t memory_used;
+    uint64_t hits;
+    uint64_t misses;
+} section_cache;
+
+section_cache* create_section_cache(composition* comp, size_t memory_limit);
+void free_section_cache(section_cache* cache);
+
+/* Returns 1 if the play order entry os is at the start of can be copied
+   from an earlier render that started in the same state. */
+int section_cache_matches(const section_cache_entry* cached, const output_state* os,
+                          const section* sec);
+
+/* Renders the play order entry os is at the start of into out, which must
+   hold play_order_entry_length samples, and leaves os at the start of the
+   next entry. With a cache, repeats are copied from the first render and
+   first renders are kept while they fit under the memory limit. cache may
+   be NULL. */
+void render_play_order_entry(output_state* os, composition* comp,
+                             section_cache* cache, int32_t* out);
+
+#endif
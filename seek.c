@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "seek.h"
+
+sample_index* build_sample_index(composition* comp, const output_state* prototype) {
+    sample_index* index = calloc(sizeof(sample_index), 1);
+
+    index->comp = comp;
+    index->num_entries = comp->num_play_order;
+    index->num_oscillators = prototype->num_oscillators;
+    index->entries = plan_entry_jobs(comp, prototype, NULL);
+    if(index->num_entries > 0) {
+        const entry_job* last = index->entries + index->num_entries - 1;
+        index->length = last->offset + last->length;
+    }
+    return index;
+}
+
+void free_sample_index(sample_index* index) {
+    if(index == NULL) {
+        return;
+    }
+    free_entry_jobs(index->comp, index->entries);
+    free(index);
+}
+
+int locate_sample(const sample_index* index, uint64_t sample, sample_position* position) {
+    int32_t low = 0, high = index->num_entries - 1;
+    const entry_job* job;
+    const section* sec;
+    uint64_t within;
+    int32_t note_samples;
+
+    if(sample >= index->length) {
+        return -1;
+    }
+
+    /* The last entry starting at or before sample. Empty entries start
+       where the next one does, so this skips past them. */
+    while(low < high) {
+        int32_t middle = low + (high - low + 1) / 2;
+        if(index->entries[middle].offset <= sample) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    job = index->entries + low;
+    sec = index->comp->sections + index->comp->play_order[low];
+    note_samples = samples_per_note(sec);
+    within = sample - job->offset;
+
+    position->entry = low;
+    position->note = (int32_t)(within / note_samples);
+    position->sample = (int32_t)(within % note_samples);
+    return 0;
+}
+
+uint64_t note_start_sample(const sample_index* index, int32_t entry, int32_t note) {
+    const section* sec = index->comp->sections + index->comp->play_order[entry];
+    return index->entries[entry].offset + (uint64_t)note * samples_per_note(sec);
+}
+
+int seek_output_state(output_state* os, const sample_index* index, uint64_t sample) {
+    sample_position position;
+
+    if(os->num_oscillators != index->num_oscillators) {
+        fprintf(stderr, "Output state has %d oscillators, the sample index was built for %d.\n",
+                os->num_oscillators, index->num_oscillators);
+        return -1;
+    }
+    if(sample == index->length) {
+        os->section_num = index->num_entries;
+        os->section_playing = 0;
+        os->is_playing = 0;
+        return 0;
+    }
+    if(locate_sample(index, sample, &position) != 0) {
+        fprintf(stderr, "Can't seek to sample %llu of a %llu sample composition.\n",
+                (unsigned long long)sample, (unsigned long long)index->length);
+        return -1;
+    }
+
+    enter_play_order_note(os, index->comp, position.entry, index->entries[position.entry].start,
+                          position.note, position.sample);
+    return 0;
+}
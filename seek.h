@@ -0,0 +1,55 @@
+#ifndef SEEK_H
+#define SEEK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinysynth.h"
+#include "parallel.h"
+
+/* Seeking to any sample of a composition without rendering what comes
+   before it. A sample index is built with one walk of the play order, as
+   render_composition_parallel plans its jobs: it records the sample each
+   entry starts at and the oscillator state it starts in. Every note of an
+   entry lasts samples_per_note, so where a note starts follows from its
+   entry's start. Seeking is a binary search for the entry, then a walk of
+   that entry's notes up to the sample, after which render_block carries on
+   exactly as if it had rendered everything before.
+
+   An index belongs to the composition it was built for and holds states for
+   output states with the prototype's oscillator count. It must be rebuilt
+   if the composition's play order, tempos, note counts or notes change. */
+
+typedef struct _sample_position {
+    int32_t entry;  /* play order entry */
+    int32_t note;   /* note within the entry's section */
+    int32_t sample; /* sample within the note */
+} sample_position;
+
+typedef struct _sample_index {
+    composition* comp;
+    int32_t num_entries;
+    int32_t num_oscillators;
+    uint64_t length;     /* samples the whole composition renders to */
+    entry_job* entries;  /* one per play order entry, with its offset, length
+                            and starting oscillator state */
+} sample_index;
+
+sample_index* build_sample_index(composition* comp, const output_state* prototype);
+void free_sample_index(sample_index* index);
+
+/* Finds the entry, note and sample within it that sample falls on. Returns
+   -1 if sample is at or past the end of the composition. */
+int locate_sample(const sample_index* index, uint64_t sample, sample_position* position);
+
+/* The sample note of play order entry starts at. */
+uint64_t note_start_sample(const sample_index* index, int32_t entry, int32_t note);
+
+/* Puts os at sample of the composition, ready for render_block to carry on
+   from, with its engine settings left as they are. os must have the
+   oscillator count the index was built for. Seeking to the composition's
+   length leaves os finished. Returns -1, leaving os alone, if sample is
+   past the end. */
+int seek_output_state(output_state* os, const sample_index* index, uint64_t sample);
+
+#endif
@@ -0,0 +1,523 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sink.h"
+#include "tinysynth.h"
+#include "encode.h"
+#include "trace.h"
+
+/* Bytes buffered between write calls. A multiple of the page size so the
+   buffer can be handed straight to the kernel. */
+#define SINK_BUFFER_SIZE (1 << 20)
+#define SINK_BUFFER_ALIGN 4096
+
+#define WAV_HEADER_SIZE 44
+/* WAVE_FORMAT_EXTENSIBLE adds 24 bytes to the fmt chunk, and float output
+   a 12 byte fact chunk. */
+#define WAV_EXTENSION_SIZE 24
+#define WAV_FACT_SIZE 12
+#define WAV_MAX_HEADER_SIZE (WAV_HEADER_SIZE + WAV_EXTENSION_SIZE + WAV_FACT_SIZE)
+
+/* Samples converted at a time into an aligned scratch buffer before being
+   copied into the output. */
+#define ENCODE_CHUNK_SIZE 1024
+
+/* Seed for the 16 bit dither, fixed so renders are repeatable. */
+#define DITHER_SEED 0x746e7973
+
+struct _output_sink {
+    int fd;
+    int is_stdout;
+    int is_null;
+    sink_container container;
+    sink_format format;
+    int channels;
+    size_t sample_size; /* bytes per sample, 0 for compressed output */
+    dither_state dither;
+
+    /* compressed output, a block's worth of frames at a time */
+    rice_encoder* rice;
+    int32_t* block;
+    size_t block_frames;
+    uint8_t* coded;
+    uint64_t frames_written;
+    uint64_t total_frames;
+
+    /* buffered mode */
+    uint8_t* buffer;
+    size_t buffered;
+
+    /* mmap mode */
+    uint8_t* map;
+    size_t map_size;
+    size_t map_offset;
+};
+
+static int host_is_little_endian(void) {
+    const uint16_t probe = 1;
+    return *(const uint8_t*)&probe == 1;
+}
+
+static void put_le16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+/* Float and more than two channels need WAVE_FORMAT_EXTENSIBLE, which
+   readers otherwise may reject or guess speaker positions for. */
+static int wav_is_extensible(sink_format format, int channels) {
+    return channels > 2 || format == SINK_F32;
+}
+
+static size_t wav_header_size(sink_format format, int channels) {
+    if(!wav_is_extensible(format, channels)) {
+        return WAV_HEADER_SIZE;
+    }
+    return WAV_HEADER_SIZE + WAV_EXTENSION_SIZE + (format == SINK_F32 ? WAV_FACT_SIZE : 0);
+}
+
+/* Fills in a WAV header of wav_header_size bytes for frames frames, or for
+   a length not known yet if length_known is 0: the canonical 44 bytes for
+   mono or stereo PCM, otherwise a WAVE_FORMAT_EXTENSIBLE fmt chunk, and a
+   fact chunk for float. Lengths that don't fit in the RIFF size fields, or
+   aren't known, are written as 0xffffffff, which most readers take to mean
+   "read until end of file". */
+static void make_wav_header(uint8_t* header, sink_format format, uint16_t channels,
+                            uint64_t frames, int length_known) {
+    /* The KSDATAFORMAT_SUBTYPE GUID after its leading format tag. */
+    static const uint8_t subformat_tail[12] = {
+        0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+    };
+    const uint16_t bits = format == SINK_S16 ? 16 : 32;
+    const uint16_t tag = format == SINK_F32 ? 3 : 1; /* float or PCM */
+    const int extensible = wav_is_extensible(format, channels);
+    const size_t header_size = wav_header_size(format, channels);
+    uint64_t data_size = frames * channels * (bits / 8);
+    uint32_t data_field = 0xffffffff;
+    uint32_t riff_field = 0xffffffff;
+    uint32_t frames_field = 0xffffffff;
+    uint8_t* p = header + 12;
+
+    if(length_known && data_size <= 0xffffffff - (header_size - 8)) {
+        data_field = (uint32_t)data_size;
+        riff_field = (uint32_t)(data_size + header_size - 8);
+        frames_field = (uint32_t)frames;
+    }
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, riff_field);
+    memcpy(header + 8, "WAVE", 4);
+
+    memcpy(p, "fmt ", 4);
+    put_le32(p + 4, extensible ? 16 + WAV_EXTENSION_SIZE : 16);
+    put_le16(p + 8, extensible ? 0xfffe : tag);
+    put_le16(p + 10, channels);
+    put_le32(p + 12, sample_rate);
+    put_le32(p + 16, sample_rate * channels * (bits / 8));
+    put_le16(p + 20, channels * (bits / 8));
+    put_le16(p + 22, bits);
+    p += 24;
+
+    if(extensible) {
+        /* Front centre for mono and front left and right for stereo. Any
+           more channels are the mix and its stems rather than speakers, so
+           they're left unassigned. */
+        uint32_t channel_mask = channels == 1 ? 0x4 : channels == 2 ? 0x3 : 0;
+
+        put_le16(p, WAV_EXTENSION_SIZE - 2);
+        put_le16(p + 2, bits);
+        put_le32(p + 4, channel_mask);
+        put_le32(p + 8, tag);
+        memcpy(p + 12, subformat_tail, sizeof(subformat_tail));
+        p += WAV_EXTENSION_SIZE;
+    }
+    if(format == SINK_F32) {
+        memcpy(p, "fact", 4);
+        put_le32(p + 4, 4);
+        put_le32(p + 8, frames_field);
+        p += WAV_FACT_SIZE;
+    }
+
+    memcpy(p, "data", 4);
+    put_le32(p + 4, data_field);
+}
+
+static int write_all(int fd, const uint8_t* data, size_t size) {
+    while(size > 0) {
+        ssize_t written = write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int flush_sink(output_sink* sink) {
+    int ret = write_all(sink->fd, sink->buffer, sink->buffered);
+    sink->buffered = 0;
+    return ret;
+}
+
+/* Copies count samples of sample_size bytes into dest in the byte order
+   the container wants. */
+static void store_samples(output_sink* sink, uint8_t* dest, const void* samples, size_t count) {
+    if(sink->container == SINK_RAW || host_is_little_endian()) {
+        memcpy(dest, samples, count * sink->sample_size);
+    } else if(sink->sample_size == 2) {
+        for(size_t i = 0; i < count; ++i) {
+            put_le16(dest + i * 2, (uint16_t)((const int16_t*)samples)[i]);
+        }
+    } else {
+        for(size_t i = 0; i < count; ++i) {
+            uint32_t bits;
+            memcpy(&bits, (const uint8_t*)samples + i * 4, sizeof(bits));
+            put_le32(dest + i * 4, bits);
+        }
+    }
+}
+
+/* Converts samples to the sink's format into dest, which needn't be
+   aligned. */
+static void encode_samples(output_sink* sink, uint8_t* dest, const int32_t* samples, size_t count) {
+    union {
+        int16_t s16[ENCODE_CHUNK_SIZE];
+        float f32[ENCODE_CHUNK_SIZE];
+    } scratch;
+
+    if(sink->format == SINK_S32) {
+        store_samples(sink, dest, samples, count);
+        return;
+    }
+    while(count > 0) {
+        size_t n = count < ENCODE_CHUNK_SIZE ? count : ENCODE_CHUNK_SIZE;
+
+        if(sink->format == SINK_S16) {
+            encode_s16(&sink->dither, scratch.s16, samples, n);
+        } else {
+            encode_f32(scratch.f32, samples, n);
+        }
+        store_samples(sink, dest, &scratch, n);
+        dest += n * sink->sample_size;
+        samples += n;
+        count -= n;
+    }
+}
+
+static int open_mapped_sink(output_sink* sink, const char* filename) {
+    size_t header_size = sink->container == SINK_WAV
+                         ? wav_header_size(sink->format, sink->channels) : 0;
+
+    sink->map_size = header_size + sink->total_frames * sink->channels * sink->sample_size;
+    sink->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(sink->fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    if(ftruncate(sink->fd, sink->map_size) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    sink->map = mmap(NULL, sink->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, 0);
+    if(sink->map == MAP_FAILED) {
+        sink->map = NULL;
+        perror("mmap");
+        return -1;
+    }
+    if(header_size > 0) {
+        make_wav_header(sink->map, sink->format, sink->channels, sink->total_frames, 1);
+    }
+    sink->map_offset = header_size;
+    return 0;
+}
+
+static int open_buffered_sink(output_sink* sink, const char* filename) {
+    void* buffer = NULL;
+
+    if(sink->is_stdout) {
+        sink->fd = STDOUT_FILENO;
+    } else {
+        sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(sink->fd < 0) {
+            perror(filename);
+            return -1;
+        }
+    }
+
+    if(posix_memalign(&buffer, SINK_BUFFER_ALIGN, SINK_BUFFER_SIZE) != 0) {
+        fprintf(stderr, "Couldn't allocate output buffer.\n");
+        return -1;
+    }
+    sink->buffer = buffer;
+
+    if(sink->container == SINK_WAV) {
+        make_wav_header(sink->buffer, sink->format, sink->channels, sink->total_frames,
+                        sink->total_frames != 0);
+        sink->buffered = wav_header_size(sink->format, sink->channels);
+    } else if(sink->format == SINK_RICE) {
+        make_rice_header(sink->buffer, sink->channels);
+        sink->buffered = RICE_HEADER_SIZE;
+    }
+    return 0;
+}
+
+static void free_sink(output_sink* sink) {
+    if(sink->map != NULL) {
+        munmap(sink->map, sink->map_size);
+    }
+    if(sink->fd >= 0 && !sink->is_stdout) {
+        close(sink->fd);
+    }
+    free_rice_encoder(sink->rice);
+    free(sink->block);
+    free(sink->coded);
+    free(sink->buffer);
+    free(sink);
+}
+
+const char* sink_extension(sink_container container, sink_format format) {
+    if(container == SINK_WAV) {
+        return ".wav";
+    }
+    switch(format) {
+    case SINK_S16:
+        return ".s16";
+    case SINK_F32:
+        return ".f32";
+    case SINK_RICE:
+        return ".tsr";
+    default:
+        return ".s32";
+    }
+}
+
+output_sink* open_sink(const char* filename, sink_container container, sink_format format,
+                       int channels, int use_mmap, uint64_t total_frames) {
+    output_sink* sink;
+    int ret;
+
+    if(container == SINK_WAV && format == SINK_RICE) {
+        fprintf(stderr, "Compressed output can't go in a WAV file.\n");
+        return NULL;
+    }
+
+    sink = calloc(sizeof(output_sink), 1);
+    sink->fd = -1;
+    sink->container = container;
+    sink->format = format;
+    sink->channels = channels > 0 ? channels : 1;
+    sink->sample_size = format == SINK_S16 ? 2 : format == SINK_RICE ? 0 : 4;
+    sink->total_frames = total_frames;
+    init_dither(&sink->dither, DITHER_SEED);
+    if(format == SINK_RICE) {
+        sink->rice = create_rice_encoder(sink->channels);
+        sink->block = malloc((size_t)RICE_BLOCK_FRAMES * sink->channels * sizeof(int32_t));
+        sink->coded = malloc(rice_block_bound(sink->channels, RICE_BLOCK_FRAMES));
+    }
+
+    if(filename == NULL) {
+        sink->is_null = 1;
+        return sink;
+    }
+    sink->is_stdout = strcmp(filename, "-") == 0;
+
+    if(use_mmap && !sink->is_stdout && total_frames > 0 && format != SINK_RICE) {
+        ret = open_mapped_sink(sink, filename);
+    } else {
+        ret = open_buffered_sink(sink, filename);
+    }
+
+    if(ret != 0) {
+        free_sink(sink);
+        return NULL;
+    }
+    return sink;
+}
+
+/* Copies bytes into the buffer, writing it out whenever it fills. */
+static int buffer_bytes(output_sink* sink, const uint8_t* data, size_t size) {
+    while(size > 0) {
+        size_t n = size < SINK_BUFFER_SIZE - sink->buffered ? size : SINK_BUFFER_SIZE - sink->buffered;
+
+        memcpy(sink->buffer + sink->buffered, data, n);
+        sink->buffered += n;
+        data += n;
+        size -= n;
+
+        if(sink->buffered == SINK_BUFFER_SIZE && flush_sink(sink) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Codes the frames gathered so far as a block. */
+static int write_block(output_sink* sink) {
+    size_t size;
+
+    if(sink->block_frames == 0) {
+        return 0;
+    }
+    size = encode_rice_block(sink->rice, sink->coded, sink->block, sink->block_frames);
+    sink->block_frames = 0;
+    return buffer_bytes(sink, sink->coded, size);
+}
+
+static int write_compressed(output_sink* sink, const int32_t* samples, size_t frames) {
+    while(frames > 0) {
+        size_t n = RICE_BLOCK_FRAMES - sink->block_frames;
+
+        if(n > frames) {
+            n = frames;
+        }
+        memcpy(sink->block + sink->block_frames * sink->channels, samples,
+               n * sink->channels * sizeof(*samples));
+        sink->block_frames += n;
+        samples += n * sink->channels;
+        frames -= n;
+
+        if(sink->block_frames == RICE_BLOCK_FRAMES && write_block(sink) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_samples(output_sink* sink, const int32_t* samples, size_t frames) {
+    size_t count = frames * sink->channels;
+
+    sink->frames_written += frames;
+
+    if(sink->is_null) {
+        return 0;
+    }
+    if(sink->format == SINK_RICE) {
+        return write_compressed(sink, samples, frames);
+    }
+    if(sink->map != NULL) {
+        size_t room = (sink->map_size - sink->map_offset) / sink->sample_size;
+        if(count > room) {
+            fprintf(stderr, "Render ran past the length the output was sized for.\n");
+            return -1;
+        }
+        encode_samples(sink, sink->map + sink->map_offset, samples, count);
+        sink->map_offset += count * sink->sample_size;
+        return 0;
+    }
+
+    while(count > 0) {
+        size_t room = (SINK_BUFFER_SIZE - sink->buffered) / sink->sample_size;
+        size_t n = count < room ? count : room;
+
+        encode_samples(sink, sink->buffer + sink->buffered, samples, n);
+        sink->buffered += n * sink->sample_size;
+        samples += n;
+        count -= n;
+
+        if(sink->buffered + sink->sample_size > SINK_BUFFER_SIZE && flush_sink(sink) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int sink_write(output_sink* sink, const int32_t* samples, size_t count) {
+    uint64_t start;
+    int ret;
+
+    if(!TRACE_ON()) {
+        return write_samples(sink, samples, count);
+    }
+    start = trace_now_ns();
+    ret = write_samples(sink, samples, count);
+    trace_write(count, trace_now_ns() - start);
+    return ret;
+}
+
+int sink_flush(output_sink* sink) {
+    uint64_t start = TRACE_ON() ? trace_now_ns() : 0;
+    int ret = 0;
+
+    if(!sink->is_null && sink->map == NULL) {
+        ret = write_block(sink);
+        if(ret == 0) {
+            ret = flush_sink(sink);
+        }
+    }
+    if(TRACE_ON()) {
+        trace_write(0, trace_now_ns() - start);
+    }
+    return ret;
+}
+
+static int finish_sink(output_sink* sink) {
+    int ret = 0;
+    /* A total of 0 means the length wasn't known, so the header needs it
+       even if nothing was written. */
+    int length_changed = sink->total_frames == 0 || sink->frames_written != sink->total_frames;
+
+    if(sink->is_null) {
+        free_sink(sink);
+        return 0;
+    }
+    if(sink->map != NULL) {
+        size_t used = sink->map_offset;
+        if(length_changed && sink->container == SINK_WAV) {
+            make_wav_header(sink->map, sink->format, sink->channels, sink->frames_written, 1);
+        }
+        munmap(sink->map, sink->map_size);
+        sink->map = NULL;
+        if(used != sink->map_size && ftruncate(sink->fd, used) != 0) {
+            perror("ftruncate");
+            ret = -1;
+        }
+    } else {
+        ret = write_block(sink);
+        if(ret == 0) {
+            ret = flush_sink(sink);
+        }
+        if(ret == 0 && length_changed && sink->container == SINK_WAV && !sink->is_stdout) {
+            uint8_t header[WAV_MAX_HEADER_SIZE];
+            ssize_t header_size = wav_header_size(sink->format, sink->channels);
+
+            make_wav_header(header, sink->format, sink->channels, sink->frames_written, 1);
+            if(pwrite(sink->fd, header, header_size, 0) != header_size) {
+                perror("pwrite");
+                ret = -1;
+            }
+        }
+    }
+
+    free_sink(sink);
+    return ret;
+}
+
+int close_sink(output_sink* sink) {
+    uint64_t start = TRACE_ON() ? trace_now_ns() : 0;
+    int ret = finish_sink(sink);
+
+    if(TRACE_ON()) {
+        trace_write(0, trace_now_ns() - start);
+    }
+    return ret;
+}
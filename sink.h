@@ -0,0 +1,53 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum _sink_container {
+    SINK_RAW = 0, /* headerless native-endian samples, as sound.s32 always was */
+    SINK_WAV = 1  /* RIFF/WAVE, PCM or float, WAVE_FORMAT_EXTENSIBLE for
+                     float or more than two channels */
+} sink_container;
+
+/* How each sample is stored. Conversions and compression happen as the
+   sink writes, see encode.h. */
+typedef enum _sink_format {
+    SINK_S32 = 0,  /* 32 bit signed, the render exactly */
+    SINK_S16 = 1,  /* 16 bit signed, the top 16 bits with dither */
+    SINK_F32 = 2,  /* 32 bit float, full scale at -1.0 to 1.0 */
+    SINK_RICE = 3  /* lossless compressed 32 bit, raw container only */
+} sink_format;
+
+typedef struct _output_sink output_sink;
+
+/* The file extension for a container and format, as ".s32". */
+const char* sink_extension(sink_container container, sink_format format);
+
+/* Opens an output sink writing to filename, or to stdout if filename is "-",
+   or a null sink that counts samples and discards them if filename is NULL.
+   Each frame is channels interleaved samples, stored in the given format.
+   total_frames is the length of the render in frames if it is known up
+   front, or 0 if it isn't. With use_mmap set and a known length, a regular
+   file is sized once and written through a shared mapping instead of write
+   calls; compressed output is never mapped, as its size isn't known.
+   Returns NULL and prints why on failure. */
+output_sink* open_sink(const char* filename, sink_container container, sink_format format,
+                       int channels, int use_mmap, uint64_t total_frames);
+
+/* Queues count frames, count * channels samples, for output. Returns 0 on
+   success, -1 on a write error. */
+int sink_write(output_sink* sink, const int32_t* samples, size_t count);
+
+/* Writes out whatever is buffered now rather than when the buffer fills,
+   for output that has to keep up with playback. Compressed output ends its
+   block early to do so. Returns 0 on success, -1 on
+   a write error. */
+int sink_flush(output_sink* sink);
+
+/* Flushes whatever is buffered, fixes up the container header if the length
+   turned out different from what was promised, and frees the sink.
+   Returns 0 on success, -1 if anything failed. */
+int close_sink(output_sink* sink);
+
+#endif
@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stream.h"
+#include "seek.h"
+
+#define CACHE_LINE_SIZE 64
+
+/* Single producer, single consumer ring of samples. head counts samples
+   ever written and only moves on the render thread; tail counts samples
+   ever read and only moves on the player. Each side publishes its counter
+   with a release store and reads the other's with an acquire load, so the
+   samples between them are always complete. The counters sit on their own
+   cache lines so the two threads don't fight over one. */
+typedef struct _sample_ring {
+    int32_t* samples;
+    size_t capacity; /* a power of two */
+    size_t mask;
+    char head_padding[CACHE_LINE_SIZE];
+    uint64_t head;
+    char tail_padding[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    uint64_t tail;
+    char finished_padding[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    int finished; /* set once head won't move again */
+} sample_ring;
+
+typedef struct _stream_renderer {
+    sample_ring* ring;
+    output_state* os;
+    composition* comp;
+    size_t block_size;
+    uint64_t block_ns;
+    uint64_t deadline_misses;
+    uint64_t worst_render_ns;
+} stream_renderer;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+static void sleep_until_ns(uint64_t when) {
+    struct timespec ts;
+    ts.tv_sec = when / 1000000000;
+    ts.tv_nsec = when % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        ;
+    }
+}
+
+/* Renders up to count samples straight into the ring at head, wrapping at
+   the end. Returns how many were rendered, fewer than count only at the
+   end of the composition. */
+static size_t render_into_ring(stream_renderer* renderer, uint64_t head, size_t count) {
+    sample_ring* ring = renderer->ring;
+    size_t offset = head & ring->mask;
+    size_t first = count < ring->capacity - offset ? count : ring->capacity - offset;
+    size_t frames = render_block(renderer->os, renderer->comp, ring->samples + offset, first);
+
+    if(frames == first && first < count) {
+        frames += render_block(renderer->os, renderer->comp, ring->samples, count - first);
+    }
+    return frames;
+}
+
+static void* render_thread_main(void* arg) {
+    stream_renderer* renderer = arg;
+    sample_ring* ring = renderer->ring;
+
+    for(;;) {
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t start, elapsed;
+        size_t frames;
+
+        if(head - tail + renderer->block_size > ring->capacity) {
+            sleep_ns(renderer->block_ns / 4);
+            continue;
+        }
+
+        start = now_ns();
+        frames = render_into_ring(renderer, head, renderer->block_size);
+        elapsed = now_ns() - start;
+
+        __atomic_store_n(&ring->head, head + frames, __ATOMIC_RELEASE);
+
+        if(frames < renderer->block_size) {
+            break;
+        }
+        if(elapsed > renderer->worst_render_ns) {
+            renderer->worst_render_ns = elapsed;
+        }
+        if(elapsed > renderer->block_ns) {
+            renderer->deadline_misses++;
+        }
+    }
+
+    __atomic_store_n(&ring->finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Writes count samples from the ring at tail to the sink, wrapping at the
+   end. */
+static int play_from_ring(sample_ring* ring, uint64_t tail, size_t count, output_sink* sink) {
+    size_t offset = tail & ring->mask;
+    size_t first = count < ring->capacity - offset ? count : ring->capacity - offset;
+
+    if(sink_write(sink, ring->samples + offset, first) != 0) {
+        return -1;
+    }
+    if(first < count && sink_write(sink, ring->samples, count - first) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* The player: every block_ns it takes a block out of the ring and writes
+   it, padding with silence if the renderer hasn't kept up. */
+static int play_stream(sample_ring* ring, size_t block_size, uint64_t block_ns,
+                       output_sink* sink, stream_stats* stats) {
+    int32_t* silence = calloc(sizeof(int32_t), block_size);
+    uint64_t tail = 0;
+    uint64_t deadline;
+    int ret = 0;
+
+    /* Wait for the ring to fill, or for a composition shorter than it to
+       finish rendering. */
+    while(!__atomic_load_n(&ring->finished, __ATOMIC_ACQUIRE)
+          && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + block_size <= ring->capacity) {
+        sleep_ns(block_ns / 4);
+    }
+
+    deadline = now_ns();
+    while(ret == 0) {
+        /* finished has to be read before head: once it's set, head is final. */
+        int finished = __atomic_load_n(&ring->finished, __ATOMIC_ACQUIRE);
+        uint64_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+        size_t count = available < block_size ? available : block_size;
+
+        if(count == 0 && finished) {
+            break;
+        }
+
+        ret = play_from_ring(ring, tail, count, sink);
+        tail += count;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        /* A short block is only the end of the composition if the renderer
+           has said so; finished is looked at again in case it just has. */
+        if(ret == 0 && count < block_size && !__atomic_load_n(&ring->finished, __ATOMIC_ACQUIRE)) {
+            stats->underruns++;
+            ret = sink_write(sink, silence, block_size - count);
+        }
+        if(ret == 0) {
+            ret = sink_flush(sink);
+        }
+        stats->blocks_played++;
+
+        deadline += block_ns;
+        sleep_until_ns(deadline);
+    }
+
+    free(silence);
+    return ret;
+}
+
+int stream_composition(output_state* os, composition* comp, output_sink* sink,
+                       const stream_options* options, stream_stats* stats) {
+    sample_ring ring;
+    stream_renderer renderer;
+    pthread_t render_thread;
+    size_t block_size = options->block_size > 0 ? options->block_size : 1;
+    int ret;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&ring, 0, sizeof(ring));
+    ring.capacity = 1;
+    while(ring.capacity < options->buffer_size || ring.capacity < 2 * block_size) {
+        ring.capacity <<= 1;
+    }
+    ring.mask = ring.capacity - 1;
+    ring.samples = malloc(ring.capacity * sizeof(*ring.samples));
+    if(ring.samples == NULL) {
+        fprintf(stderr, "Couldn't allocate a %zu sample stream buffer.\n", ring.capacity);
+        return -1;
+    }
+
+    memset(&renderer, 0, sizeof(renderer));
+    renderer.ring = &ring;
+    renderer.os = os;
+    renderer.comp = comp;
+    renderer.block_size = block_size;
+    renderer.block_ns = (uint64_t)block_size * 1000000000 / sample_rate;
+
+    stats->buffer_size = ring.capacity;
+    stats->block_ns = renderer.block_ns;
+
+    if(options->start > 0) {
+        sample_index* index = build_sample_index(comp, os);
+        int seeked = seek_output_state(os, index, options->start);
+
+        free_sample_index(index);
+        if(seeked != 0) {
+            free(ring.samples);
+            return -1;
+        }
+    } else {
+        setup_output_state_for_composition(os, comp);
+    }
+    if(pthread_create(&render_thread, NULL, render_thread_main, &renderer) != 0) {
+        fprintf(stderr, "Couldn't start the render thread.\n");
+        free(ring.samples);
+        return -1;
+    }
+
+    ret = play_stream(&ring, block_size, renderer.block_ns, sink, stats);
+
+    /* If the sink failed, drain the ring so the render thread can finish. */
+    while(!__atomic_load_n(&ring.finished, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&ring.tail, __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        sleep_ns(renderer.block_ns / 4);
+    }
+    pthread_join(render_thread, NULL);
+
+    stats->deadline_misses = renderer.deadline_misses;
+    stats->worst_render_ns = renderer.worst_render_ns;
+    free(ring.samples);
+    return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinysynth.h"
+#include "sink.h"
+
+/* Real-time playback. A render thread fills a lock-free single producer,
+   single consumer ring buffer a block at a time, and the calling thread
+   takes a block out every block's worth of wall clock time and writes it
+   to the sink, as a sound card would. Playback starts once the ring is
+   full, so latency is bounded by its size. */
+
+typedef struct _stream_options {
+    size_t block_size;  /* samples rendered and played at a time */
+    size_t buffer_size; /* samples the ring holds, rounded up to a power of
+                           two of at least two blocks */
+    uint64_t start;     /* sample of the composition to start playing from */
+} stream_options;
+
+typedef struct _stream_stats {
+    size_t buffer_size;        /* ring size actually used */
+    uint64_t blocks_played;
+    uint64_t underruns;        /* blocks that weren't ready when due and were
+                                  padded with silence */
+    uint64_t deadline_misses;  /* blocks that took longer to render than to
+                                  play */
+    uint64_t worst_render_ns;  /* longest time taken to render a block */
+    uint64_t block_ns;         /* how long a block takes to play */
+} stream_stats;
+
+/* Plays the composition from the start sample on through the sink in real
+   time, with os set up as for render_block, filling in stats as it goes.
+   The sink is flushed after every block. Returns 0 on success, -1 if the
+   start is past the end, the render thread couldn't be started or the sink
+   failed. */
+int stream_composition(output_state* os, composition* comp, output_sink* sink,
+                       const stream_options* options, stream_stats* stats);
+
+#endif
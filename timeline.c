@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timeline.h"
+
+section_timeline* create_section_timeline(void) {
+    return calloc(sizeof(section_timeline), 1);
+}
+
+void free_section_timeline(section_timeline* timeline) {
+    if(timeline == NULL) {
+        return;
+    }
+    free(timeline->events);
+    free(timeline->active);
+    free(timeline->num_active);
+    free(timeline);
+}
+
+static int32_t clamp_to(int32_t value, int32_t low, int32_t high) {
+    if(value < low) {
+        return low;
+    } else if(value > high) {
+        return high;
+    }
+    return value;
+}
+
+static void add_cut(section_timeline* timeline, int32_t cut) {
+    int32_t i = timeline->num_cuts;
+
+    for(int32_t j = 0; j < timeline->num_cuts; ++j) {
+        if(timeline->cuts[j] == cut) {
+            return;
+        }
+    }
+    while(i > 0 && timeline->cuts[i - 1] > cut) {
+        timeline->cuts[i] = timeline->cuts[i - 1];
+        --i;
+    }
+    timeline->cuts[i] = cut;
+    timeline->num_cuts++;
+}
+
+void compile_section_timeline(section_timeline* timeline, const section* sec,
+                              int32_t num_oscillators) {
+    int32_t length = samples_per_note(sec);
+    int32_t attack_end = clamp_to(envelope_size, 0, length);
+    int32_t release_begin = clamp_to(length - envelope_size + 1, 0, length);
+    int32_t release_after_attack = clamp_to(length - envelope_size + 1, attack_end, length);
+    size_t count;
+
+    timeline->note_samples = length;
+    timeline->num_notes = sec->num_notes;
+    timeline->num_voices = num_oscillators < sec->num_instruments ? num_oscillators : sec->num_instruments;
+    if(timeline->num_voices < 0) {
+        timeline->num_voices = 0;
+    }
+
+    count = (size_t)timeline->num_notes * timeline->num_voices;
+    if(count > timeline->capacity) {
+        free(timeline->events);
+        free(timeline->active);
+        timeline->events = malloc(count * sizeof(voice_event));
+        timeline->active = malloc(count * sizeof(int32_t));
+        timeline->capacity = count;
+    }
+    if(timeline->num_notes > timeline->note_capacity) {
+        free(timeline->num_active);
+        timeline->num_active = malloc(timeline->num_notes * sizeof(int32_t));
+        timeline->note_capacity = timeline->num_notes;
+    }
+
+    timeline->num_cuts = 0;
+    add_cut(timeline, 0);
+    add_cut(timeline, attack_end);
+    add_cut(timeline, release_begin);
+    add_cut(timeline, release_after_attack);
+    add_cut(timeline, length);
+
+    for(int32_t n = 0; n < timeline->num_notes; ++n) {
+        voice_event* events = timeline->events + (size_t)n * timeline->num_voices;
+        int32_t* active = timeline->active + (size_t)n * timeline->num_voices;
+
+        timeline->num_active[n] = 0;
+        for(int32_t i = 0; i < timeline->num_voices; ++i) {
+            const instrument* inst = sec->instruments + i;
+            const note* current = inst->notes + n;
+            voice_event* event = events + i;
+            int released = n + 1 >= sec->num_notes || inst->notes[n + 1].pitch != 255;
+
+            memset(event, 0, sizeof(*event));
+            event->pitch = current->pitch;
+            event->gain = gaintable[current->gain];
+            event->strike = n == 0 || current->pitch != 255;
+            if(event->strike) {
+                event->frequency = freqtable[current->pitch];
+                if(inst->type == FM) {
+                    event->fm_freq = (event->frequency / inst->fm_denominator) * inst->fm_numerator;
+                    event->fm_gain = inst->fm_gain;
+                }
+            }
+
+            /* Only a struck note ramps up, and a note rings on at full gain
+               into one that sustains it. */
+            if(current->pitch != 255) {
+                event->attack_end = attack_end;
+                event->release_begin = released ? release_after_attack : length;
+            } else {
+                event->attack_end = 0;
+                event->release_begin = released ? release_begin : length;
+            }
+
+            /* A sustained note sounds at whatever was last struck. */
+            if(!event->strike) {
+                event->frequency = (event - timeline->num_voices)->frequency;
+            }
+            if(event->frequency != 0) {
+                active[timeline->num_active[n]++] = i;
+            }
+        }
+    }
+}
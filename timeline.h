@@ -0,0 +1,77 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tinysynth.h"
+
+/* A section compiled into a flat timeline of voice events, one per note for
+   every sounding voice, in note order. Everything render_block used to work
+   out from the notes while playing is looked up once here: the frequency,
+   FM settings and gain a struck note retunes its oscillator to, and where
+   within the note its envelope ramps start and stop. Rendering a note is
+   then applying its events and mixing whole ramp segments between the
+   section's cuts, with no per-note peeking at neighbouring notes.
+
+   Every note of a section is samples_per_note long, so the places a ramp
+   can start or stop are the same for every note: the end of an attack, and
+   the start of a release with or without an attack before it. Those, plus
+   the note's ends, are the cuts.
+
+   Each note also lists the voices that sound in it, those whose last
+   strike wasn't a rest, so rendering never visits a silent voice, and a
+   note where nothing sounds is just zeros. */
+
+typedef struct _voice_event {
+    int8_t strike;         /* 1 if the note retunes the oscillator and resets
+                              its phase, 0 if it sustains the last pitch */
+    uint8_t pitch;
+    int32_t frequency;     /* freqtable value the note sounds at, the last
+                              struck pitch's for a sustain */
+    uint32_t fm_freq;      /* for a struck FM note */
+    int32_t fm_gain;
+    int32_t gain;          /* gaintable value */
+    int32_t attack_end;    /* sample within the note the attack ramp ends at,
+                              0 for none */
+    int32_t release_begin; /* sample within the note the release ramp starts
+                              at, note_samples for none */
+} voice_event;
+
+#define TIMELINE_MAX_CUTS 5
+
+typedef struct _section_timeline {
+    int32_t note_samples;
+    int32_t num_notes;
+    int32_t num_voices;    /* instruments with an oscillator to play on */
+    voice_event* events;   /* num_notes runs of num_voices events */
+    int32_t* active;       /* num_notes runs of num_voices slots, each
+                              starting with the note's sounding voices */
+    int32_t* num_active;   /* per note, how many voices sound */
+    size_t capacity;       /* events and active slots allocated */
+    int32_t note_capacity; /* num_active entries allocated */
+    int32_t num_cuts;
+    int32_t cuts[TIMELINE_MAX_CUTS]; /* ascending, from 0 to note_samples */
+} section_timeline;
+
+section_timeline* create_section_timeline(void);
+void free_section_timeline(section_timeline* timeline);
+
+/* Compiles sec for an output state with num_oscillators oscillators,
+   reusing the timeline's memory. */
+void compile_section_timeline(section_timeline* timeline, const section* sec,
+                              int32_t num_oscillators);
+
+/* The events of note n, one per voice. */
+static inline const voice_event* note_events(const section_timeline* timeline, int32_t n) {
+    return timeline->events + (size_t)n * timeline->num_voices;
+}
+
+/* The voices sounding in note n, in ascending order, and how many. */
+static inline const int32_t* note_active_voices(const section_timeline* timeline, int32_t n,
+                                                int32_t* count) {
+    *count = timeline->num_active[n];
+    return timeline->active + (size_t)n * timeline->num_voices;
+}
+
+#endif
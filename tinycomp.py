@@ -8,6 +8,9 @@ notevals = ['C', 'C#', 'D', 'D#', 'E', 'F', 'F#', 'G', 'G#', 'A', 'A#', 'B']
 
 oscillatortypes = ['square', 'sawtooth', 'triangle', 'sine'] # leaving out FM for now because UI is complicated.
 
+# Version of binformat.txt written by composition.binary_rep.
+format_version = 2
+
 
 def pitch2text(pitch):
     octave = pitch / 12
@@ -69,7 +72,7 @@ class section(object):
                 instr.del_note()
 
     def binary_rep(self):
-        header = struct.pack("hbb", self.tempo, self.num_instruments, self.num_notes)
+        header = struct.pack("=hii", self.tempo, self.num_instruments, self.num_notes)
         binary_instruments = [i.binary_rep() for i in self.instruments]
         return header + ''.join(binary_instruments)
 
@@ -96,10 +99,15 @@ class composition(object):
         self.sections.append(section())
 
     def binary_rep(self):
-        header = "TINYSYNTH" + struct.pack("ii", self.num_sections, self.play_order_length)
+        header = "TINYSYNTH" + struct.pack("=iiii", -1, format_version, self.num_sections, self.play_order_length)
         for po in self.play_order:
-            header += struct.pack("i", po)
+            header += struct.pack("=i", po)
         binary_sections = [s.binary_rep() for s in self.sections]
+        # offsets of each section from the start of the file
+        offset = len(header) + 8 * self.num_sections
+        for rep in binary_sections:
+            header += struct.pack("=Q", offset)
+            offset += len(rep)
         return header + ''.join(binary_sections)
             
 
@@ -1,7 +1,15 @@
 #include <stdlib.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <math.h>
+#include <string.h>
+
+#include "tinysynth.h"
+#include "wavetable.h"
+#include "fixedpoint.h"
+#include "voicebank.h"
+#include "composition.h"
+#include "timeline.h"
+#include "trace.h"
 
 const double pi = 3.141592653589793238462643383279502;
 
@@ -75,23 +83,6 @@ const int32_t gaintable[] = {0x0, 0x2666666, 0x4cccccc, 0x7333333, 0x9999999,
 			     0xdf333333, 0xe1999999, 0xe4000000, 0xe6666666,
 			     0xe8cccccc, 0xeb333333, 0xed999999, 0xf0000000};
 
-typedef enum _oscillator_type {
-    SQUARE = 0,
-    SAWTOOTH = 1,
-    TRIANGLE = 2,
-    SINE = 3,
-    FM = 4
-} oscillator_type;
-
-typedef struct _oscillator {
-    int8_t type;
-    uint32_t phase;
-    int32_t frequency;
-    uint32_t fm_phase;
-    uint32_t fm_freq;
-    int32_t fm_gain;
-} oscillator;
-
 int32_t generate_next_osc_sample(oscillator* osc, int32_t gain) {
     if(osc->type != FM) {
         osc->phase += ((UINT32_MAX / sample_rate) * osc->frequency);
@@ -140,141 +131,562 @@ int32_t generate_next_osc_sample(oscillator* osc, int32_t gain) {
     };
 }
 
-typedef struct _note {
-    uint8_t pitch;
-    uint8_t gain;
-} note;
-
-typedef struct _instrument {
-    int8_t type;
-    int16_t fm_numerator, fm_denominator, fm_gain;
-    note* notes; // size is section.num_notes
-} instrument;
-
-typedef struct _section {
-    int16_t tempo; /* in beats per minute */
-    int8_t num_instruments;
-    int8_t num_notes;
-    instrument* instruments;
-} section;
-
-typedef struct _composition {
-    int32_t num_play_order;
-    int32_t* play_order;
-    int32_t num_sections;
-    section* sections;
-} composition;
-
-typedef struct _output_state {
-    int8_t is_playing;
-    int8_t section_playing;
-    int8_t note_num;
-    int32_t sample_num;
-    int32_t section_num;
-    int8_t num_oscillators;
-    oscillator* oscillators;
-} output_state;
-
-output_state* create_output_state(int8_t num_oscillators) {
+output_state* create_output_state(int32_t num_oscillators) {
     output_state* ret = calloc(sizeof(output_state), 1);
     ret->is_playing = 1;
     ret->section_playing = 1;
     ret->num_oscillators = num_oscillators;
     ret->section_num = 0;
     ret->oscillators = calloc(sizeof(oscillator), num_oscillators);
+    ret->engine = ENGINE_LIBM;
+    ret->bank = create_voice_bank(num_oscillators);
+    ret->span_scratch = malloc(3 * (size_t)num_oscillators * sizeof(int32_t) + 1);
+    ret->timeline = create_section_timeline();
+    init_wavetables();
+    init_fixed_tables();
     return ret;
 }
 
+void free_output_state(output_state* os) {
+    free_voice_bank(os->bank);
+    free(os->span_scratch);
+    free_section_timeline(os->timeline);
+    free(os->oscillators);
+    free(os);
+}
+
 const int16_t envelope_size = 400;
 
+int32_t samples_per_note(const section* sec) {
+    return (sample_rate * 60) / sec->tempo;
+}
+
+/* Retunes the oscillator for a struck note. */
+static void strike_oscillator(oscillator* osc, const voice_event* event) {
+    osc->frequency = event->frequency;
+    osc->phase = 0;
+    if(osc->type == FM) {
+        osc->fm_freq = event->fm_freq;
+        osc->fm_gain = event->fm_gain;
+    }
+}
+
+/* Moves the output state on to the next note of the section, retuning every
+   oscillator whose instrument doesn't sustain through it. Oscillators past
+   the section's instruments were silenced when it started and stay so. */
+static void advance_note(output_state* os, section* sec) {
+    const voice_event* events;
+    int32_t i;
+
+    ++os->note_num;
+    os->sample_num = 0;
+
+    if(os->note_num >= sec->num_notes) {
+        os->section_playing = 0;
+        return;
+    }
+
+    events = note_events(os->timeline, os->note_num);
+    for(i = 0; i < os->timeline->num_voices; ++i) {
+        if(events[i].strike) {
+            strike_oscillator(os->oscillators + i, events + i);
+        }
+    }
+}
+
+static int32_t next_osc_sample(output_state* os, oscillator* osc, int32_t gain) {
+    if(os->engine == ENGINE_TABLE) {
+        return generate_next_table_sample(osc, gain, os->interpolate);
+    } else if(os->engine == ENGINE_FIXED) {
+        return generate_next_fixed_sample(osc, gain);
+    }
+    return generate_next_osc_sample(osc, gain);
+}
+
+/* Fills out with the next n samples of an oscillator from whichever engine
+   the output state uses. */
+static void generate_osc_samples(output_state* os, oscillator* osc, int32_t gain,
+                                 int32_t* out, int32_t n) {
+    if(os->engine == ENGINE_TABLE) {
+        generate_table_osc_samples(osc, gain, out, n, os->interpolate);
+    } else if(os->engine == ENGINE_FIXED) {
+        generate_fixed_osc_samples(osc, gain, out, n);
+    } else {
+        for(int32_t i = 0; i < n; ++i) {
+            out[i] = generate_next_osc_sample(osc, gain);
+        }
+    }
+}
+
 int32_t generate_next_section_sample(output_state* os, section* sec) {
+    const voice_event* events = note_events(os->timeline, os->note_num);
+    int32_t end_sample_num = samples_per_note(sec);
+    int32_t num_active;
+    const int32_t* active = note_active_voices(os->timeline, os->note_num, &num_active);
     int32_t ret = 0;
-    int8_t i;
-    int32_t end_sample_num = ((sample_rate * 60) / sec->tempo);
 
+    for(int32_t k = 0; k < num_active; ++k) {
+        int32_t i = active[k];
+        int32_t sample = next_osc_sample(os, os->oscillators + i, events[i].gain);
 
-    for(i = 0; i < os->num_oscillators && i < sec->num_instruments; ++i) {
-        uint8_t current_pitch = sec->instruments[i].notes[os->note_num].pitch;
-        uint8_t next_pitch;
-        if(sec->num_notes > os->note_num + 1) {
-            next_pitch = sec->instruments[i].notes[os->note_num + 1].pitch;
+        if(os->sample_num < events[i].attack_end) {
+            ret = mix_add(ret, (sample / envelope_size) * (os->sample_num + 1));
+        } else if(os->sample_num >= events[i].release_begin) {
+            ret = mix_add(ret, (sample / envelope_size) * (end_sample_num - os->sample_num + 1));
         } else {
-            next_pitch = 0;
+            ret = mix_add(ret, sample);
+        }
+    }
+
+    ++os->sample_num;
+    if(os->sample_num >= end_sample_num) {
+        advance_note(os, sec);
+    }
+
+    return ret;
+}
+
+uint64_t play_order_entry_length(composition* comp, int32_t entry) {
+    section* sec = comp->sections + comp->play_order[entry];
+    return (uint64_t)samples_per_note(sec) * sec->num_notes;
+}
+
+uint64_t composition_length(composition* comp) {
+    uint64_t length = 0;
+
+    for(int32_t i = 0; i < comp->num_play_order; ++i) {
+        length += play_order_entry_length(comp, i);
+    }
+    return length;
+}
+
+/* Oscillators are generated this many samples at a time before being
+   enveloped and mixed. */
+#define MIX_CHUNK_SIZE 256
+
+/* Adds n samples of one oscillator into out. env is the envelope multiplier
+   for the first sample, stepping by env_step each sample after; an env of 0
+   means the oscillator plays at full gain. */
+static void mix_oscillator_span(output_state* os, oscillator* osc, int32_t gain,
+                                int32_t* out, int32_t n, int32_t env, int32_t env_step) {
+    int32_t raw[MIX_CHUNK_SIZE];
+    int32_t i;
+
+    while(n > 0) {
+        int32_t count = n < MIX_CHUNK_SIZE ? n : MIX_CHUNK_SIZE;
+
+        generate_osc_samples(os, osc, gain, raw, count);
+        if(env == 0) {
+            for(i = 0; i < count; ++i) {
+                out[i] = mix_add(out[i], raw[i]);
+            }
+        } else {
+            for(i = 0; i < count; ++i) {
+                out[i] = mix_add(out[i], (raw[i] / envelope_size) * env);
+                env += env_step;
+            }
+        }
+
+        out += count;
+        n -= count;
+    }
+}
+
+static int32_t clamp_sample_num(int32_t sample_num, int32_t low, int32_t high) {
+    if(sample_num < low) {
+        return low;
+    } else if(sample_num > high) {
+        return high;
+    }
+    return sample_num;
+}
+
+/* Works out where a voice's envelope ramps fall within the span
+   [begin, end) of the current note: an attack ramp over the first
+   envelope_size samples of a newly struck note, a release ramp over the last
+   envelope_size samples before a note that isn't sustained, and full gain in
+   between. */
+static void note_envelope(const voice_event* event, int32_t begin, int32_t end,
+                          int32_t* attack_end, int32_t* release_begin) {
+    *attack_end = clamp_sample_num(event->attack_end, begin, end);
+    *release_begin = clamp_sample_num(event->release_begin, begin, end);
+}
+
+/* Renders the span one oscillator at a time. The envelope is worked out
+   once per oscillator for the whole span rather than every sample. With
+   stems, each oscillator is rendered into its own stem at stem_offset
+   first, and the stem then added to the mix. Stems are cleared when the
+   span starts, so silent ones are written too. */
+static void render_note_span_per_oscillator(output_state* os, int32_t* out, int32_t* const* stems,
+                                            size_t stem_offset, int32_t begin, int32_t end) {
+    const voice_event* events = note_events(os->timeline, os->note_num);
+    int32_t end_sample_num = os->timeline->note_samples;
+    int32_t num_active;
+    const int32_t* active = note_active_voices(os->timeline, os->note_num, &num_active);
+
+    for(int32_t k = 0; k < num_active; ++k) {
+        int32_t i = active[k];
+        int32_t gain = events[i].gain;
+        int32_t attack_end, release_begin;
+        int32_t* dest = stems != NULL ? stems[i] + stem_offset : out;
+        uint64_t start = 0;
+
+        if(TRACE_ON()) {
+            start = trace_now_ns();
+        }
+        note_envelope(events + i, begin, end, &attack_end, &release_begin);
+        mix_oscillator_span(os, os->oscillators + i, gain, dest,
+                            attack_end - begin, begin + 1, 1);
+        mix_oscillator_span(os, os->oscillators + i, gain, dest + (attack_end - begin),
+                            release_begin - attack_end, 0, 0);
+        mix_oscillator_span(os, os->oscillators + i, gain, dest + (release_begin - begin),
+                            end - release_begin, end_sample_num - release_begin + 1, -1);
+        if(stems != NULL) {
+            for(int32_t x = 0; x < end - begin; ++x) {
+                out[x] = mix_add(out[x], dest[x]);
+            }
+        }
+        if(TRACE_ON()) {
+            trace_oscillator(os->oscillators[i].type, end - begin, trace_now_ns() - start);
+        }
+    }
+    if(TRACE_ON()) {
+        trace_voices(num_active, end - begin);
+    }
+}
+
+/* The voice bank mixes every type at once, so its time is shared out
+   between types by how many of its voices are of each. */
+static void trace_voice_bank(output_state* os, const int32_t* source, int32_t n, uint64_t ns) {
+    int32_t voices_of_type[FM + 1] = {0};
+    int32_t num_voices = os->bank->num_voices;
+
+    for(int32_t lane = 0; lane < num_voices; ++lane) {
+        int type = os->oscillators[source[lane]].type;
+        if(type >= 0 && type <= FM) {
+            voices_of_type[type]++;
+        }
+    }
+    for(int type = 0; type <= FM; ++type) {
+        if(voices_of_type[type] > 0) {
+            trace_oscillator(type, (uint64_t)n * voices_of_type[type],
+                             ns * voices_of_type[type] / num_voices);
+        }
+    }
+    trace_voices(num_voices, n);
+}
+
+/* Renders the span through the voice bank, all sounding oscillators at once.
+   The span is split at the section's cuts that fall inside it, so that
+   within each piece every voice is either ramping linearly or at full
+   gain. */
+static void render_note_span_voice_bank(output_state* os, int32_t* out,
+                                        int32_t begin, int32_t end) {
+    const section_timeline* timeline = os->timeline;
+    const voice_event* events = note_events(timeline, os->note_num);
+    voice_bank* bank = os->bank;
+    int32_t end_sample_num = timeline->note_samples;
+    /* Per lane attack ends, release starts and oscillators. */
+    int32_t* attack_end = os->span_scratch;
+    int32_t* release_begin = attack_end + os->num_oscillators;
+    int32_t* source = release_begin + os->num_oscillators;
+    int32_t cuts[TIMELINE_MAX_CUTS + 2];
+    int32_t num_cuts = 0;
+    int32_t num_active;
+    const int32_t* active = note_active_voices(timeline, os->note_num, &num_active);
+    uint64_t start = 0;
+    int32_t lane, j;
+
+    clear_voice_bank(bank);
+    for(int32_t k = 0; k < num_active; ++k) {
+        int32_t i = active[k];
+
+        lane = add_voice(bank, os->oscillators + i, events[i].gain);
+        source[lane] = i;
+        note_envelope(events + i, begin, end, attack_end + lane, release_begin + lane);
+    }
+
+    cuts[num_cuts++] = begin;
+    for(j = 0; j < timeline->num_cuts; ++j) {
+        if(timeline->cuts[j] > begin && timeline->cuts[j] < end) {
+            cuts[num_cuts++] = timeline->cuts[j];
         }
-        if(os->oscillators[i].frequency != 0) {
-            int32_t sample = generate_next_osc_sample(os->oscillators + i,
-                                                      gaintable[sec->instruments[i].notes[os->note_num].gain]);
-            if(current_pitch != 255 && os->sample_num < envelope_size) {
-                ret += (sample / envelope_size) * (os->sample_num + 1);
-            } else if(next_pitch != 255 && os->sample_num + envelope_size > end_sample_num) {
-                ret += (sample / envelope_size) * (end_sample_num - os->sample_num + 1);
+    }
+    cuts[num_cuts++] = end;
+
+    if(TRACE_ON()) {
+        start = trace_now_ns();
+    }
+    for(j = 0; j + 1 < num_cuts; ++j) {
+        int32_t piece_begin = cuts[j];
+
+        for(lane = 0; lane < bank->num_voices; ++lane) {
+            if(piece_begin < attack_end[lane]) {
+                bank->env[lane] = piece_begin + 1;
+                bank->env_step[lane] = 1;
+            } else if(piece_begin >= release_begin[lane]) {
+                bank->env[lane] = end_sample_num - piece_begin + 1;
+                bank->env_step[lane] = -1;
             } else {
-                ret += sample;
+                bank->env[lane] = 0;
+                bank->env_step[lane] = 0;
             }
         }
+        mix_voice_bank(bank, out + (piece_begin - begin), cuts[j + 1] - piece_begin, os->interpolate);
     }
 
-    ++os->sample_num;
-    if(os->sample_num >= end_sample_num) {
-        ++os->note_num;
-        printf("note %d\n", os->note_num);
+    if(TRACE_ON()) {
+        trace_voice_bank(os, source, end - begin, trace_now_ns() - start);
+    }
+
+    for(lane = 0; lane < bank->num_voices; ++lane) {
+        store_voice(bank, lane, os->oscillators + source[lane]);
+    }
+}
+
+/* Renders n samples of the current note, which must not run past its end.
+   A note nothing sounds in is only zeros. The voice bank only produces the
+   mix, so stems are rendered one oscillator at a time, which the table
+   engine does bit for bit the same. */
+static void render_note_span(output_state* os, int32_t* out, int32_t* const* stems,
+                             size_t stem_offset, int32_t n) {
+    int32_t begin = os->sample_num;
+    int32_t end = os->sample_num + n;
+
+    memset(out, 0, n * sizeof(*out));
+    if(stems != NULL) {
+        for(int32_t i = 0; i < os->num_oscillators; ++i) {
+            memset(stems[i] + stem_offset, 0, n * sizeof(*stems[i]));
+        }
+    }
+
+    if(os->timeline->num_active[os->note_num] == 0) {
+        if(TRACE_ON()) {
+            trace_voices(0, n);
+        }
+    } else if(os->engine == ENGINE_TABLE && stems == NULL) {
+        render_note_span_voice_bank(os, out, begin, end);
+    } else {
+        render_note_span_per_oscillator(os, out, stems, stem_offset, begin, end);
+    }
+
+    os->sample_num = end;
+}
+
+/* Moves on to the next entry in the play order, or stops playing if there
+   isn't one. */
+static void advance_section(output_state* os, composition* comp) {
+    os->section_num++;
+    if(os->section_num < comp->num_play_order) {
+        os->section_playing = 1;
+        os->note_num = 0;
         os->sample_num = 0;
+        setup_output_state_for_section(os, comp->sections + comp->play_order[os->section_num]);
+    } else {
+        os->is_playing = 0;
+    }
+}
 
-        if(os->note_num >= sec->num_notes) {
-            os->section_playing = 0;
-        } else {
-            for(i = 0; i < os->num_oscillators; ++i) {
-                if(i >= sec->num_instruments) {
-                    printf("osc %d silence\n", i);
-                    os->oscillators[i].frequency = 0;
-                    os->oscillators[i].phase = 0;
-                } else if(sec->instruments[i].notes[os->note_num].pitch != 255) {
-                    uint8_t pitch = sec->instruments[i].notes[os->note_num].pitch;
-                    uint8_t gain = sec->instruments[i].notes[os->note_num].gain;
-                    printf("osc %d pitch %d gain %d\n", i, pitch, gain);
-                    os->oscillators[i].frequency = freqtable[pitch];
-                    os->oscillators[i].phase = 0;
-                    if(sec->instruments[i].type == FM) {
-                        os->oscillators[i].fm_freq = (os->oscillators[i].frequency / sec->instruments[i].fm_denominator) * sec->instruments[i].fm_numerator;
-                        os->oscillators[i].fm_gain = sec->instruments[i].fm_gain;
-                    }
-                }
+/* Records the start of note n of play order entry entry, whose timeline os
+   has compiled, and the voices it strikes. Only called as a note starts to
+   render or is copied, so walks that skip through the play order without
+   rendering leave no events. */
+static void trace_note_start(const output_state* os, const section* sec, int32_t entry,
+                             int32_t n) {
+    const voice_event* events = note_events(os->timeline, n);
+
+    trace_event(n == 0 ? TRACE_SECTION : TRACE_NOTE, entry, n, 0, 0, 0);
+    for(int32_t i = 0; i < os->timeline->num_voices; ++i) {
+        if(events[i].strike) {
+            trace_event(TRACE_STRIKE, entry, n, i, events[i].pitch,
+                        sec->instruments[i].notes[n].gain);
+        }
+    }
+}
+
+static size_t render_block_into(output_state* os, composition* comp, int32_t* out,
+                                int32_t* const* stems, size_t frames) {
+    size_t done = 0;
+
+    while(done < frames && os->is_playing) {
+        section* sec = comp->sections + comp->play_order[os->section_num];
+        int32_t end_sample_num = samples_per_note(sec);
+        size_t n = end_sample_num - os->sample_num;
+
+        if(!os->section_playing || os->note_num >= sec->num_notes) {
+            advance_section(os, comp);
+            continue;
+        }
+
+        if(n > frames - done) {
+            n = frames - done;
+        }
+
+        if(TRACE_ON() && os->sample_num == 0) {
+            trace_note_start(os, sec, os->section_num, os->note_num);
+        }
+        render_note_span(os, out + done, stems, done, (int32_t)n);
+        done += n;
+
+        if(os->sample_num >= end_sample_num) {
+            advance_note(os, sec);
+        }
+    }
+
+    if(TRACE_ON()) {
+        trace_render(done);
+    }
+    return done;
+}
+
+size_t render_block(output_state* os, composition* comp, int32_t* out, size_t frames) {
+    return render_block_into(os, comp, out, NULL, frames);
+}
+
+size_t render_block_stems(output_state* os, composition* comp, int32_t* out,
+                          int32_t* const* stems, size_t frames) {
+    return render_block_into(os, comp, out, stems, frames);
+}
+
+void trace_play_order_entry(output_state* os, composition* comp, int32_t entry) {
+    section* sec = comp->sections + comp->play_order[entry];
+
+    compile_section_timeline(os->timeline, sec, os->num_oscillators);
+    for(int32_t n = 0; n < sec->num_notes; ++n) {
+        trace_note_start(os, sec, entry, n);
+    }
+}
+
+void skip_play_order_entry(output_state* os, composition* comp) {
+    section* sec = comp->sections + comp->play_order[os->section_num];
+    uint32_t note_samples = samples_per_note(sec);
+
+    /* Carrier phases are reset when the next entry is set up, but FM
+       modulator phases carry on through the whole composition. They advance
+       by a fixed step each sample an oscillator sounds, so a note's worth can
+       be added in one go. */
+    while(os->section_playing && os->note_num < sec->num_notes) {
+        for(int32_t i = 0; i < os->num_oscillators && i < sec->num_instruments; ++i) {
+            oscillator* osc = os->oscillators + i;
+            if(osc->frequency != 0 && osc->type == FM) {
+                osc->fm_phase += phase_increment(osc->fm_freq) * note_samples;
             }
         }
+        advance_note(os, sec);
     }
 
-    return ret;
+    advance_section(os, comp);
 }
 
 void setup_output_state_for_section(output_state* os, section* sec) {
+    const voice_event* events;
+
+    compile_section_timeline(os->timeline, sec, os->num_oscillators);
+    events = note_events(os->timeline, os->note_num);
+
     for(int i = 0; i < os->num_oscillators; ++i) {
-        if(i < sec->num_instruments) {
+        if(i < sec->num_instruments && os->note_num < sec->num_notes) {
             os->oscillators[i].type = sec->instruments[i].type;
-            uint8_t pitch = sec->instruments[i].notes[os->note_num].pitch;
-            uint8_t gain = sec->instruments[i].notes[os->note_num].gain;
-            printf("osc %d pitch %d gain %d\n", i, pitch, gain);
-            os->oscillators[i].frequency = freqtable[pitch];
-            os->oscillators[i].phase = 0;
-            if(sec->instruments[i].type == FM) {
-                os->oscillators[i].fm_freq = (os->oscillators[i].frequency / sec->instruments[i].fm_denominator) *  sec->instruments[i].fm_numerator;
-                os->oscillators[i].fm_gain = sec->instruments[i].fm_gain;
-            }
+            strike_oscillator(os->oscillators + i, events + i);
         } else {
+            if(i < sec->num_instruments) {
+                os->oscillators[i].type = sec->instruments[i].type;
+            }
             os->oscillators[i].frequency = 0;
             os->oscillators[i].phase = 0;
         }
     }
+}
+
+void enter_play_order_entry(output_state* os, composition* comp, int32_t entry,
+                            const oscillator* start) {
+    memcpy(os->oscillators, start, os->num_oscillators * sizeof(*os->oscillators));
+    os->section_num = entry;
+    os->note_num = 0;
+    os->sample_num = 0;
+    os->section_playing = 1;
+    os->is_playing = 1;
+    compile_section_timeline(os->timeline, comp->sections + comp->play_order[entry],
+                             os->num_oscillators);
+}
+
+/* Moves an oscillator on by the given number of samples without rendering
+   them. */
+static void advance_oscillator(output_state* os, oscillator* osc, uint64_t samples) {
+    int32_t scratch[MIX_CHUNK_SIZE];
+
+    if(osc->frequency == 0) {
+        return;
+    }
+    if(osc->type != FM) {
+        osc->phase += phase_increment(osc->frequency) * (uint32_t)samples;
+        return;
+    }
+    while(samples > 0) {
+        int32_t count = samples < MIX_CHUNK_SIZE ? (int32_t)samples : MIX_CHUNK_SIZE;
+
+        generate_osc_samples(os, osc, 0, scratch, count);
+        samples -= count;
+    }
+}
+
+void enter_play_order_note(output_state* os, composition* comp, int32_t entry,
+                           const oscillator* start, int32_t note_num, int32_t sample_num) {
+    const section_timeline* timeline;
+
+    enter_play_order_entry(os, comp, entry, start);
+    timeline = os->timeline;
+
+    for(int32_t i = 0; i < timeline->num_voices; ++i) {
+        oscillator* osc = os->oscillators + i;
+        int32_t struck = note_num;
+
+        /* The first note of a section always strikes. */
+        while(struck > 0 && !note_events(timeline, struck)[i].strike) {
+            --struck;
+        }
+        for(int32_t n = 0; n < struck; ++n) {
+            const voice_event* event = note_events(timeline, n) + i;
+
+            if(event->strike) {
+                strike_oscillator(osc, event);
+            }
+            if(osc->type == FM && osc->frequency != 0) {
+                osc->fm_phase += phase_increment(osc->fm_freq) * timeline->note_samples;
+            }
+        }
+        strike_oscillator(osc, note_events(timeline, struck) + i);
+        advance_oscillator(os, osc, (uint64_t)(note_num - struck) * timeline->note_samples
+                                    + sample_num);
+    }
 
+    os->note_num = note_num;
+    os->sample_num = sample_num;
 }
 
-void populate_test_section_one(section* sec) {
+void setup_output_state_for_composition(output_state* os, composition* comp) {
+    /* Oscillators past the first section's instruments, and FM modulator
+       phases, would otherwise carry over from an earlier render. */
+    memset(os->oscillators, 0, os->num_oscillators * sizeof(*os->oscillators));
+    os->section_num = 0;
+    os->note_num = 0;
+    os->sample_num = 0;
+    os->section_playing = 1;
+    os->is_playing = comp->num_play_order > 0;
+
+    if(os->is_playing) {
+        setup_output_state_for_section(os, comp->sections + comp->play_order[0]);
+    }
+}
+
+void populate_test_section_one(composition* comp, section* sec) {
     sec->tempo = 240;
     sec->num_instruments = 4;
     sec->num_notes = 32;
-    sec->instruments = calloc(sizeof(instrument), 4);
+    sec->instruments = allocate_instruments(comp, 4);
 
     for(int i = 0; i < 4; ++i) {
-        sec->instruments[i].notes = calloc(sizeof(note), 32);
+        sec->instruments[i].notes = allocate_notes(comp, 32);
         for(int j = 0; j < 32; ++j) {
             sec->instruments[i].notes[j].pitch = 255;
             sec->instruments[i].notes[j].gain = 18;
@@ -344,14 +756,14 @@ void populate_test_section_one(section* sec) {
     sec->instruments[3].notes[0].pitch = 0;
 }
 
-void populate_test_section_two(section* sec) {
+void populate_test_section_two(composition* comp, section* sec) {
     sec->tempo = 240;
     sec->num_instruments = 4;
     sec->num_notes = 32;
-    sec->instruments = calloc(sizeof(instrument), 4);
+    sec->instruments = allocate_instruments(comp, 4);
 
     for(int i = 0; i < 4; ++i) {
-        sec->instruments[i].notes = calloc(sizeof(note), 32);
+        sec->instruments[i].notes = allocate_notes(comp, 32);
         for(int j = 0; j < 32; ++j) {
             sec->instruments[i].notes[j].pitch = 255;
             sec->instruments[i].notes[j].gain = 23;
@@ -426,111 +838,11 @@ void populate_test_section_two(section* sec) {
 }
 
 void populate_test_composition(composition* comp) {
-    comp->num_play_order = 3;
-    comp->play_order = calloc(sizeof(int32_t), 3);
+    create_composition(comp, 3, 2, 8, 8 * 32);
     comp->play_order[0] = 0;
     comp->play_order[1] = 1;
     comp->play_order[2] = 0;
 
-    comp->num_sections = 2;
-    comp->sections = calloc(sizeof(section), 2);
-    populate_test_section_one(comp->sections);
-    populate_test_section_two(comp->sections + 1);
-}
-
-composition read_from_file(char* filename) {
-    FILE* infile = fopen(filename, "r");
-
-    char header[7];
-
-    fread(header, 1, 9, infile); /* should be making sure this is "TINYSYNTH" */
-
-    composition comp;
-
-    if(infile == NULL) {
-        return comp;
-    }
-
-    fread(&comp.num_sections, sizeof(comp.num_sections), 1, infile);
-    fread(&comp.num_play_order, sizeof(comp.num_play_order), 1, infile);
-
-    printf("%d, %d\n", comp.num_sections, comp.num_play_order);
-
-    comp.sections = calloc(comp.num_sections, sizeof(*comp.sections));
-    comp.play_order = calloc(comp.num_play_order, sizeof(*comp.play_order));
-
-    fread(comp.play_order, sizeof(*comp.play_order), comp.num_play_order, infile);
-
-    for(int i = 0; i < comp.num_sections; ++i) {
-        printf("section %d\n", i);
-        section* sec = &comp.sections[i];
-        fread(&sec->tempo, sizeof(sec->tempo), 1, infile);
-        fread(&sec->num_instruments, sizeof(sec->num_instruments), 1, infile);
-        fread(&sec->num_notes, sizeof(sec->num_notes), 1, infile);
-        printf("tempo: %d, num instruments: %d, num notes: %d\n", sec->tempo, sec->num_instruments, sec->num_notes);
-
-        sec->instruments = calloc(sec->num_instruments, sizeof(*sec->instruments));
-
-        for(int j = 0; j < sec->num_instruments; ++j) {
-            printf("instrument %d\n", j);
-            instrument* inst = &sec->instruments[j];
-
-            fread(&inst->type, sizeof(inst->type), 1, infile);
-            fread(&inst->fm_numerator, sizeof(inst->fm_numerator), 1, infile);
-            fread(&inst->fm_denominator, sizeof(inst->fm_denominator), 1, infile);
-            fread(&inst->fm_gain, sizeof(inst->fm_gain), 1, infile);
-
-            printf("type: %d, num: %d, den: %d, fm gain: %d\n",
-                   inst->type, inst->fm_numerator, inst->fm_denominator, inst->fm_gain);
-
-            inst->notes = calloc(sec->num_notes, sizeof(*inst->notes));
-
-            for(int k = 0; k < sec->num_notes; ++k) {
-                note* n = &inst->notes[k];
-
-                fread(&n->pitch, sizeof(n->pitch), 1, infile);
-                fread(&n->gain, sizeof(n->gain), 1, infile);
-                printf("note %d, pitch %d, gain %d\n", k, n->pitch, n->gain);
-            }
-        }
-    }
-
-    return comp;
-}
-
-int main(int argc, char** argv) {
-    if(argc != 2) {
-        printf("Incorrect number of arguments.\n");
-        return -1;
-    }
-
-    printf("Reading from file: %s\n", argv[1]);
-
-    composition comp = read_from_file(argv[1]);
-    
-
-    FILE* outfile = fopen("sound.s32", "w");
-    output_state* os = create_output_state(16);
-
-    /*populate_test_composition(&comp);*/
-    setup_output_state_for_section(os, comp.sections + comp.play_order[0]);
-
-    while(os->is_playing) {
-        int32_t signal = generate_next_section_sample(os, comp.sections + comp.play_order[os->section_num]);
-        fwrite(&signal, 1, sizeof(signal), outfile);
-
-        if(!os->section_playing) {
-            os->section_num++;
-            if(os->section_num < comp.num_play_order) {
-                os->section_playing = 1;
-                os->note_num = 0;
-                os->sample_num = 0;
-                setup_output_state_for_section(os, comp.sections + comp.play_order[os->section_num]);
-            } else {
-                os->is_playing = 0;
-            }
-        }
-    }
-
-    fclose(outfile);
+    populate_test_section_one(comp, comp->sections);
+    populate_test_section_two(comp, comp->sections + 1);
 }
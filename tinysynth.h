@@ -0,0 +1,156 @@
+#ifndef TINYSYNTH_H
+#define TINYSYNTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const int32_t sample_rate;
+extern const int32_t freqtable[];
+extern const int32_t gaintable[];
+extern const int16_t envelope_size;
+
+/* Mixes wrap around on overflow, in every engine and kernel. Done unsigned
+   so that's what C promises rather than something every compiler just
+   happens to do. */
+static inline int32_t mix_add(int32_t a, int32_t b) {
+    return (int32_t)((uint32_t)a + (uint32_t)b);
+}
+
+typedef enum _oscillator_type {
+    SQUARE = 0,
+    SAWTOOTH = 1,
+    TRIANGLE = 2,
+    SINE = 3,
+    FM = 4
+} oscillator_type;
+
+typedef enum _osc_engine {
+    ENGINE_LIBM = 0, /* sinf and roundf every sample, the original oscillators */
+    ENGINE_TABLE = 1, /* wavetable oscillators, see wavetable.h */
+    ENGINE_FIXED = 2  /* integer only oscillators, see fixedpoint.h */
+} osc_engine;
+
+typedef struct _oscillator {
+    int8_t type;
+    uint32_t phase;
+    int32_t frequency;
+    uint32_t fm_phase;
+    uint32_t fm_freq;
+    int32_t fm_gain;
+} oscillator;
+
+typedef struct _note {
+    uint8_t pitch;
+    uint8_t gain;
+} note;
+
+typedef struct _instrument {
+    int8_t type;
+    int16_t fm_numerator, fm_denominator, fm_gain;
+    note* notes; // size is section.num_notes
+} instrument;
+
+typedef struct _section {
+    int16_t tempo; /* in beats per minute */
+    int32_t num_instruments;
+    int32_t num_notes;
+    instrument* instruments;
+} section;
+
+typedef struct _composition {
+    int32_t num_play_order;
+    int32_t* play_order;
+    int32_t num_sections;
+    section* sections;
+    char* arena; /* one block holding everything above, see composition.h */
+    size_t arena_size;
+    size_t arena_used;
+    void* mapping; /* file the notes point into, NULL if they're in the arena */
+    size_t mapping_size;
+    int8_t mapping_copied; /* the mapping is a malloced copy of the file */
+} composition;
+
+struct _voice_bank;
+struct _section_timeline;
+
+typedef struct _output_state {
+    int8_t is_playing;
+    int8_t section_playing;
+    int32_t note_num;
+    int32_t sample_num;
+    int32_t section_num;
+    int32_t num_oscillators;
+    oscillator* oscillators;
+    int8_t engine; /* an osc_engine, ENGINE_LIBM unless changed */
+    int8_t interpolate; /* linear interpolation for the table engine */
+    struct _voice_bank* bank; /* sounding voices, for the table engine */
+    int32_t* span_scratch; /* envelope breakpoints, for the table engine */
+    struct _section_timeline* timeline; /* the playing section, compiled */
+} output_state;
+
+int32_t generate_next_osc_sample(oscillator* osc, int32_t gain);
+
+output_state* create_output_state(int32_t num_oscillators);
+void free_output_state(output_state* os);
+
+/* Number of samples each note of the section lasts. */
+int32_t samples_per_note(const section* sec);
+
+/* Number of samples one entry of the play order renders to. */
+uint64_t play_order_entry_length(composition* comp, int32_t entry);
+
+/* Total number of samples the composition renders to. */
+uint64_t composition_length(composition* comp);
+
+int32_t generate_next_section_sample(output_state* os, section* sec);
+void setup_output_state_for_section(output_state* os, section* sec);
+
+/* Puts the output state at the start of play order entry with its
+   oscillators as given, which must be as render_block would have left them
+   coming into the entry. */
+void enter_play_order_entry(output_state* os, composition* comp, int32_t entry,
+                            const oscillator* start);
+
+/* As enter_play_order_entry, but puts the output state sample_num samples
+   into note note_num of the entry instead of at its start, with every
+   oscillator as render_block would have left it there, including those
+   sustaining a note struck earlier in the entry. Carrier phases and FM
+   modulator phases before the last strike are worked out arithmetically;
+   an FM carrier since its last strike has to be stepped through sample by
+   sample, as its phase depends on the modulator's. */
+void enter_play_order_note(output_state* os, composition* comp, int32_t entry,
+                           const oscillator* start, int32_t note_num, int32_t sample_num);
+
+/* Rewinds the output state to the start of the play order. */
+void setup_output_state_for_composition(output_state* os, composition* comp);
+
+/* Renders up to frames samples of the composition into out, carrying on
+   from wherever the last call stopped. Note and section changes are handled
+   inside the block. Returns the number of samples written, which is less
+   than frames only once the composition has finished playing. */
+size_t render_block(output_state* os, composition* comp, int32_t* out, size_t frames);
+
+/* As render_block, and also writes each oscillator's own contribution to
+   stems[i], for every one of the output state's oscillators, in the same
+   pass. Oscillator i plays instrument i of every section, so a stem is one
+   instrument's part, enveloped and at its gain, and the mix is the wrapping
+   sum of the stems. Each stem must hold frames samples. */
+size_t render_block_stems(output_state* os, composition* comp, int32_t* out,
+                          int32_t* const* stems, size_t frames);
+
+/* Moves an output state sitting at the start of a play order entry, or
+   just past the end of its last note, on to the start of the next entry
+   without rendering anything, leaving it exactly as render_block would
+   have. Cheap enough to find the starting state of any entry by walking the
+   play order. */
+void skip_play_order_entry(output_state* os, composition* comp);
+
+/* Records the trace events render_block would for the whole of play order
+   entry entry, for an entry copied from an earlier render rather than
+   rendered. Compiles the entry's timeline into os, so os has to be at the
+   start of that entry, or be set up again, before rendering with it. */
+void trace_play_order_entry(output_state* os, composition* comp, int32_t entry);
+
+void populate_test_composition(composition* comp);
+
+#endif
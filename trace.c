@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define NUM_TRACED_TYPES 5
+
+typedef struct _trace_record {
+    uint64_t ns; /* since tracing was enabled */
+    int32_t type;
+    int32_t entry;
+    int32_t note;
+    int32_t voice;
+    int32_t pitch;
+    int32_t gain;
+} trace_record;
+
+/* Counters are only ever added to, with relaxed atomics: nothing is read
+   back until the report, after the render threads are done. */
+typedef struct _trace_counters {
+    uint64_t samples;
+    uint64_t voice_samples;
+    uint64_t peak_voices;
+    uint64_t sections;
+    uint64_t notes;
+    uint64_t strikes;
+    uint64_t osc_samples[NUM_TRACED_TYPES];
+    uint64_t osc_ns[NUM_TRACED_TYPES];
+    uint64_t files_loaded;
+    uint64_t load_ns;
+    uint64_t samples_written;
+    uint64_t write_ns;
+} trace_counters;
+
+int trace_enabled = 0;
+
+static uint64_t trace_start_ns;
+static trace_counters counters;
+static trace_record ring[TRACE_RING_SIZE];
+static uint64_t ring_head; /* events ever recorded */
+
+static const char* const type_names[NUM_TRACED_TYPES] = {
+    "square", "sawtooth", "triangle", "sine", "fm"
+};
+
+static const char* const event_names[] = {"section", "note", "strike"};
+
+static void count(uint64_t* counter, uint64_t amount) {
+    __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int enable_tracing(void) {
+#ifdef TINYSYNTH_TRACE
+    trace_start_ns = trace_now_ns();
+    trace_enabled = 1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void trace_event(trace_event_type type, int32_t entry, int32_t note, int32_t voice,
+                 int32_t pitch, int32_t gain) {
+    uint64_t slot = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+    trace_record* record = ring + (slot & (TRACE_RING_SIZE - 1));
+
+    record->ns = trace_now_ns() - trace_start_ns;
+    record->type = type;
+    record->entry = entry;
+    record->note = note;
+    record->voice = voice;
+    record->pitch = pitch;
+    record->gain = gain;
+
+    switch(type) {
+    case TRACE_SECTION:
+        count(&counters.sections, 1);
+        break;
+    case TRACE_NOTE:
+        count(&counters.notes, 1);
+        break;
+    case TRACE_STRIKE:
+        count(&counters.strikes, 1);
+        break;
+    }
+}
+
+void trace_render(uint64_t samples) {
+    count(&counters.samples, samples);
+}
+
+void trace_voices(int32_t voices, uint64_t samples) {
+    uint64_t peak = __atomic_load_n(&counters.peak_voices, __ATOMIC_RELAXED);
+
+    count(&counters.voice_samples, (uint64_t)voices * samples);
+    while((uint64_t)voices > peak
+          && !__atomic_compare_exchange_n(&counters.peak_voices, &peak, (uint64_t)voices, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+void trace_oscillator(int type, uint64_t samples, uint64_t ns) {
+    if(type < 0 || type >= NUM_TRACED_TYPES) {
+        return;
+    }
+    count(&counters.osc_samples[type], samples);
+    count(&counters.osc_ns[type], ns);
+}
+
+void trace_load(uint64_t ns) {
+    count(&counters.files_loaded, 1);
+    count(&counters.load_ns, ns);
+}
+
+void trace_write(uint64_t samples, uint64_t ns) {
+    count(&counters.samples_written, samples);
+    count(&counters.write_ns, ns);
+}
+
+int write_trace_report(const char* filename) {
+    FILE* outfile = strcmp(filename, "-") == 0 ? stderr : fopen(filename, "w");
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    int ret = 0;
+
+    if(outfile == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    fprintf(outfile, "{\n");
+    fprintf(outfile, "  \"elapsed_ns\": %llu,\n",
+            (unsigned long long)(trace_now_ns() - trace_start_ns));
+    fprintf(outfile, "  \"samples_rendered\": %llu,\n", (unsigned long long)counters.samples);
+    fprintf(outfile, "  \"voice_samples\": %llu,\n", (unsigned long long)counters.voice_samples);
+    fprintf(outfile, "  \"average_voices\": %.3f,\n",
+            counters.samples > 0 ? (double)counters.voice_samples / counters.samples : 0.0);
+    fprintf(outfile, "  \"peak_voices\": %llu,\n", (unsigned long long)counters.peak_voices);
+    fprintf(outfile, "  \"sections\": %llu,\n", (unsigned long long)counters.sections);
+    fprintf(outfile, "  \"notes\": %llu,\n", (unsigned long long)counters.notes);
+    fprintf(outfile, "  \"strikes\": %llu,\n", (unsigned long long)counters.strikes);
+
+    fprintf(outfile, "  \"oscillators\": {\n");
+    for(int i = 0; i < NUM_TRACED_TYPES; ++i) {
+        fprintf(outfile, "    \"%s\": {\"samples\": %llu, \"ns\": %llu}%s\n", type_names[i],
+                (unsigned long long)counters.osc_samples[i], (unsigned long long)counters.osc_ns[i],
+                i + 1 < NUM_TRACED_TYPES ? "," : "");
+    }
+    fprintf(outfile, "  },\n");
+
+    fprintf(outfile, "  \"load\": {\"files\": %llu, \"ns\": %llu},\n",
+            (unsigned long long)counters.files_loaded, (unsigned long long)counters.load_ns);
+    fprintf(outfile, "  \"write\": {\"samples\": %llu, \"ns\": %llu},\n",
+            (unsigned long long)counters.samples_written, (unsigned long long)counters.write_ns);
+
+    fprintf(outfile, "  \"events_recorded\": %llu,\n", (unsigned long long)head);
+    fprintf(outfile, "  \"events\": [");
+    for(uint64_t i = first; i < head; ++i) {
+        const trace_record* record = ring + (i & (TRACE_RING_SIZE - 1));
+
+        fprintf(outfile, "%s\n    {\"ns\": %llu, \"event\": \"%s\", \"entry\": %d, \"note\": %d",
+                i > first ? "," : "", (unsigned long long)record->ns, event_names[record->type],
+                record->entry, record->note);
+        if(record->type == TRACE_STRIKE) {
+            fprintf(outfile, ", \"voice\": %d, \"pitch\": %d, \"gain\": %d}",
+                    record->voice, record->pitch, record->gain);
+        } else {
+            fprintf(outfile, "}");
+        }
+    }
+    fprintf(outfile, "%s]\n}\n", head > first ? "\n  " : "");
+
+    if(ferror(outfile)) {
+        ret = -1;
+    }
+    if(outfile != stderr && fclose(outfile) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Instrumentation for profiling renders: counters of work done and time
+   taken, and a ring buffer of the most recent note events, written out as
+   JSON. Builds made with TINYSYNTH_TRACE undefined (make TRACE_FLAGS=) compile
+   every hook away. Otherwise hooks are guarded by TRACE_ON(), a single well
+   predicted branch on a flag that stays clear unless enable_tracing is
+   called, so a render that isn't being traced does no extra work.
+
+   Every hook can be called from any render thread. Counters are updated
+   per span of samples, never per sample. */
+
+#ifdef TINYSYNTH_TRACE
+extern int trace_enabled;
+#define TRACE_ON() __builtin_expect(trace_enabled, 0)
+#else
+#define TRACE_ON() 0
+#endif
+
+/* Events kept in the ring buffer. Older ones are overwritten. */
+#define TRACE_RING_SIZE (1 << 16)
+
+typedef enum _trace_event_type {
+    TRACE_SECTION = 0, /* a play order entry started: entry */
+    TRACE_NOTE = 1,    /* a note started: entry, note */
+    TRACE_STRIKE = 2   /* a voice was struck: entry, note, voice, pitch, gain */
+} trace_event_type;
+
+/* Turns tracing on. Returns -1, and leaves it off, if the build doesn't
+   support it. */
+int enable_tracing(void);
+
+uint64_t trace_now_ns(void);
+
+void trace_event(trace_event_type type, int32_t entry, int32_t note, int32_t voice,
+                 int32_t pitch, int32_t gain);
+
+/* samples rendered by render_block, and the voice samples within them, ie.
+   each span's length times the voices sounding in it. */
+void trace_render(uint64_t samples);
+void trace_voices(int32_t voices, uint64_t samples);
+
+/* Time spent generating samples of one oscillator type. */
+void trace_oscillator(int type, uint64_t samples, uint64_t ns);
+
+void trace_load(uint64_t ns);
+void trace_write(uint64_t samples, uint64_t ns);
+
+/* Writes the counters and the ring buffer's events as JSON to filename, or
+   to stderr for "-". Returns 0 on success, -1 on failure. */
+int write_trace_report(const char* filename);
+
+#endif
@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "voicebank.h"
+#include "wavetable.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VOICE_BANK_X86 1
+#include <immintrin.h>
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+/* The vector kernels generate this many samples per voice group into a
+   stack accumulator before summing across lanes into the output. */
+#define MIX_CHUNK_SIZE 256
+
+typedef void (*voice_bank_mixer)(voice_bank* bank, int32_t* out, int32_t n, int interpolate);
+
+voice_bank* create_voice_bank(int32_t max_voices) {
+    voice_bank* bank = calloc(sizeof(voice_bank), 1);
+    int32_t capacity = (max_voices + VOICE_BANK_LANES - 1) / VOICE_BANK_LANES * VOICE_BANK_LANES;
+
+    if(capacity == 0) {
+        capacity = VOICE_BANK_LANES;
+    }
+
+    bank->capacity = capacity;
+    bank->type = calloc(sizeof(*bank->type), capacity);
+    bank->gain = calloc(sizeof(*bank->gain), capacity);
+    bank->fgain = calloc(sizeof(*bank->fgain), capacity);
+    bank->phase = calloc(sizeof(*bank->phase), capacity);
+    bank->step = calloc(sizeof(*bank->step), capacity);
+    bank->frequency = calloc(sizeof(*bank->frequency), capacity);
+    bank->fm_phase = calloc(sizeof(*bank->fm_phase), capacity);
+    bank->fm_freq = calloc(sizeof(*bank->fm_freq), capacity);
+    bank->fm_step = calloc(sizeof(*bank->fm_step), capacity);
+    bank->fm_gain = calloc(sizeof(*bank->fm_gain), capacity);
+    bank->env = calloc(sizeof(*bank->env), capacity);
+    bank->env_step = calloc(sizeof(*bank->env_step), capacity);
+    return bank;
+}
+
+void free_voice_bank(voice_bank* bank) {
+    if(bank == NULL) {
+        return;
+    }
+    free(bank->type);
+    free(bank->gain);
+    free(bank->fgain);
+    free(bank->phase);
+    free(bank->step);
+    free(bank->frequency);
+    free(bank->fm_phase);
+    free(bank->fm_freq);
+    free(bank->fm_step);
+    free(bank->fm_gain);
+    free(bank->env);
+    free(bank->env_step);
+    free(bank);
+}
+
+void clear_voice_bank(voice_bank* bank) {
+    size_t size = bank->capacity * sizeof(int32_t);
+
+    /* A zeroed lane is a square wave with no gain and no step, which adds
+       nothing to the mix. */
+    memset(bank->type, 0, size);
+    memset(bank->gain, 0, size);
+    memset(bank->fgain, 0, size);
+    memset(bank->phase, 0, size);
+    memset(bank->step, 0, size);
+    memset(bank->frequency, 0, size);
+    memset(bank->fm_phase, 0, size);
+    memset(bank->fm_freq, 0, size);
+    memset(bank->fm_step, 0, size);
+    memset(bank->fm_gain, 0, size);
+    memset(bank->env, 0, size);
+    memset(bank->env_step, 0, size);
+    bank->num_voices = 0;
+}
+
+int32_t add_voice(voice_bank* bank, const oscillator* osc, int32_t gain) {
+    int32_t lane = bank->num_voices++;
+
+    bank->type[lane] = osc->type;
+    bank->gain[lane] = gain;
+    bank->fgain[lane] = (float)gain;
+    bank->phase[lane] = osc->phase;
+    bank->step[lane] = phase_increment(osc->frequency);
+    bank->frequency[lane] = osc->frequency;
+    if(osc->type == FM) {
+        bank->fm_phase[lane] = osc->fm_phase;
+        bank->fm_freq[lane] = osc->fm_freq;
+        bank->fm_step[lane] = phase_increment(osc->fm_freq);
+        bank->fm_gain[lane] = (float)osc->fm_gain;
+    } else {
+        bank->fm_phase[lane] = 0;
+        bank->fm_freq[lane] = 0;
+        bank->fm_step[lane] = 0;
+        bank->fm_gain[lane] = 0;
+    }
+    bank->env[lane] = 0;
+    bank->env_step[lane] = 0;
+    return lane;
+}
+
+void store_voice(const voice_bank* bank, int32_t lane, oscillator* osc) {
+    osc->phase = bank->phase[lane];
+    if(osc->type == FM) {
+        osc->fm_phase = bank->fm_phase[lane];
+    }
+}
+
+/* Oscillator types present in lanes [lane, lane + count), as a bit mask. */
+static uint32_t group_types(const voice_bank* bank, int32_t lane, int32_t count) {
+    uint32_t types = 0;
+    for(int32_t i = lane; i < lane + count; ++i) {
+        types |= 1u << (bank->type[i] & 31);
+    }
+    return types;
+}
+
+static int group_has_envelope(const voice_bank* bank, int32_t lane, int32_t count) {
+    for(int32_t i = lane; i < lane + count; ++i) {
+        if(bank->env[i] != 0 || bank->env_step[i] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mix_voice_bank_scalar(voice_bank* bank, int32_t* out, int32_t n, int interpolate) {
+    int32_t raw[MIX_CHUNK_SIZE];
+
+    for(int32_t lane = 0; lane < bank->num_voices; ++lane) {
+        oscillator osc;
+        int32_t* dest = out;
+        int32_t remaining = n;
+        int32_t env = bank->env[lane];
+
+        osc.type = bank->type[lane];
+        osc.phase = bank->phase[lane];
+        osc.frequency = bank->frequency[lane];
+        osc.fm_phase = bank->fm_phase[lane];
+        osc.fm_freq = bank->fm_freq[lane];
+        osc.fm_gain = (int32_t)bank->fm_gain[lane];
+
+        while(remaining > 0) {
+            int32_t count = remaining < MIX_CHUNK_SIZE ? remaining : MIX_CHUNK_SIZE;
+
+            generate_table_osc_samples(&osc, bank->gain[lane], raw, count, interpolate);
+
+            if(env == 0) {
+                for(int32_t i = 0; i < count; ++i) {
+                    dest[i] = mix_add(dest[i], raw[i]);
+                }
+            } else {
+                for(int32_t i = 0; i < count; ++i) {
+                    dest[i] = mix_add(dest[i], (raw[i] / envelope_size) * env);
+                    env += bank->env_step[lane];
+                }
+            }
+
+            dest += count;
+            remaining -= count;
+        }
+
+        bank->phase[lane] = osc.phase;
+        bank->fm_phase[lane] = osc.fm_phase;
+        bank->env[lane] = env;
+    }
+}
+
+#ifdef VOICE_BANK_X86
+
+/* SSE2 has no 32 bit low multiply, blend or horizontal add, so those are
+   built from what it does have. */
+
+SSE2_FUNCTION static inline __m128i sse2_mullo(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* mask ? a : b, for masks that are all ones or all zeros per lane. */
+SSE2_FUNCTION static inline __m128i sse2_select(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+SSE2_FUNCTION static inline __m128 sse2_sine(__m128i phase, int interpolate) {
+    int32_t index[4];
+    __m128 a;
+
+    _mm_storeu_si128((__m128i*)index, _mm_srli_epi32(phase, WAVETABLE_FRAC_BITS));
+    a = _mm_setr_ps(sine_wavetable[index[0]], sine_wavetable[index[1]],
+                    sine_wavetable[index[2]], sine_wavetable[index[3]]);
+    if(interpolate) {
+        __m128 b = _mm_setr_ps(sine_wavetable[index[0] + 1], sine_wavetable[index[1] + 1],
+                               sine_wavetable[index[2] + 1], sine_wavetable[index[3] + 1]);
+        __m128i fraction = _mm_and_si128(phase, _mm_set1_epi32(WAVETABLE_FRAC_MASK));
+        __m128 frac = _mm_mul_ps(_mm_cvtepi32_ps(fraction), _mm_set1_ps(1.0f / (1 << WAVETABLE_FRAC_BITS)));
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), frac));
+    }
+    return a;
+}
+
+/* (sample / envelope_size) * env with C's truncating division. Every int32
+   is exact as a double and the quotient is nowhere near a rounding
+   boundary, so truncating the double quotient matches integer division. */
+SSE2_FUNCTION static inline __m128i sse2_envelope(__m128i sample, __m128i env) {
+    const __m128d divisor = _mm_set1_pd(envelope_size);
+    __m128i low = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(sample), divisor));
+    __m128i high = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(sample, _MM_SHUFFLE(1, 0, 3, 2))), divisor));
+    __m128i quotient = _mm_unpacklo_epi64(low, high);
+    __m128i scaled = sse2_mullo(quotient, env);
+    return sse2_select(_mm_cmpeq_epi32(env, _mm_setzero_si128()), sample, scaled);
+}
+
+/* Adds n samples of the four voices starting at lane into acc, which holds
+   four partial sums per sample. */
+SSE2_FUNCTION static void mix_group_sse2(voice_bank* bank, int32_t lane, int32_t* acc,
+                                         int32_t n, int interpolate) {
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);
+    const __m128i increment = _mm_set1_epi32((int32_t)(UINT32_MAX / sample_rate));
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(INT32_MAX));
+    uint32_t types = group_types(bank, lane, 4);
+    int has_envelope = group_has_envelope(bank, lane, 4);
+    __m128i type = _mm_loadu_si128((const __m128i*)(bank->type + lane));
+    __m128i gain = _mm_loadu_si128((const __m128i*)(bank->gain + lane));
+    __m128 fgain = _mm_loadu_ps(bank->fgain + lane);
+    __m128i phase = _mm_loadu_si128((const __m128i*)(bank->phase + lane));
+    __m128i step = _mm_loadu_si128((const __m128i*)(bank->step + lane));
+    __m128i frequency = _mm_loadu_si128((const __m128i*)(bank->frequency + lane));
+    __m128i fm_phase = _mm_loadu_si128((const __m128i*)(bank->fm_phase + lane));
+    __m128i fm_step = _mm_loadu_si128((const __m128i*)(bank->fm_step + lane));
+    __m128 fm_gain = _mm_loadu_ps(bank->fm_gain + lane);
+    __m128i env = _mm_loadu_si128((const __m128i*)(bank->env + lane));
+    __m128i env_step = _mm_loadu_si128((const __m128i*)(bank->env_step + lane));
+    __m128i is_square = _mm_cmpeq_epi32(type, _mm_set1_epi32(SQUARE));
+    __m128i is_saw = _mm_cmpeq_epi32(type, _mm_set1_epi32(SAWTOOTH));
+    __m128i is_triangle = _mm_cmpeq_epi32(type, _mm_set1_epi32(TRIANGLE));
+    __m128i is_sine = _mm_or_si128(_mm_cmpeq_epi32(type, _mm_set1_epi32(SINE)),
+                                   _mm_cmpeq_epi32(type, _mm_set1_epi32(FM)));
+
+    for(int32_t t = 0; t < n; ++t) {
+        __m128i sample = _mm_setzero_si128();
+        __m128i centred;
+
+        if(types & (1u << FM)) {
+            __m128i mod;
+            fm_phase = _mm_add_epi32(fm_phase, fm_step);
+            mod = _mm_cvtps_epi32(_mm_mul_ps(sse2_sine(fm_phase, interpolate), fm_gain));
+            step = sse2_mullo(increment, _mm_add_epi32(mod, frequency));
+        }
+        phase = _mm_add_epi32(phase, step);
+        centred = _mm_xor_si128(phase, sign);
+
+        if(types & (1u << SQUARE)) {
+            __m128i high = _mm_srai_epi32(phase, 31);
+            __m128i square = sse2_select(high, gain, _mm_sub_epi32(_mm_setzero_si128(), gain));
+            sample = sse2_select(is_square, square, sample);
+        }
+        if(types & (1u << SAWTOOTH)) {
+            __m128 value = _mm_mul_ps(_mm_cvtepi32_ps(centred), _mm_set1_ps(0x1p-32f));
+            sample = sse2_select(is_saw, _mm_cvtps_epi32(_mm_mul_ps(value, fgain)), sample);
+        }
+        if(types & (1u << TRIANGLE)) {
+            __m128 value = _mm_and_ps(_mm_cvtepi32_ps(centred), abs_mask);
+            value = _mm_sub_ps(_mm_mul_ps(value, _mm_set1_ps(0x1p-30f)), _mm_set1_ps(1.0f));
+            sample = sse2_select(is_triangle, _mm_cvtps_epi32(_mm_mul_ps(value, fgain)), sample);
+        }
+        if(types & ((1u << SINE) | (1u << FM))) {
+            __m128 value = sse2_sine(phase, interpolate);
+            sample = sse2_select(is_sine, _mm_cvtps_epi32(_mm_mul_ps(value, fgain)), sample);
+        }
+        if(has_envelope) {
+            sample = sse2_envelope(sample, env);
+            env = _mm_add_epi32(env, env_step);
+        }
+
+        _mm_storeu_si128((__m128i*)(acc + t * 4),
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i*)(acc + t * 4)), sample));
+    }
+
+    _mm_storeu_si128((__m128i*)(bank->phase + lane), phase);
+    _mm_storeu_si128((__m128i*)(bank->fm_phase + lane), fm_phase);
+    _mm_storeu_si128((__m128i*)(bank->env + lane), env);
+}
+
+/* out[t] += the four partial sums for sample t, four samples at a time by
+   transposing rows of acc into columns. */
+SSE2_FUNCTION static void reduce_sse2(const int32_t* acc, int32_t* out, int32_t n) {
+    int32_t t = 0;
+
+    for(; t + 4 <= n; t += 4) {
+        __m128i r0 = _mm_loadu_si128((const __m128i*)(acc + t * 4));
+        __m128i r1 = _mm_loadu_si128((const __m128i*)(acc + t * 4 + 4));
+        __m128i r2 = _mm_loadu_si128((const __m128i*)(acc + t * 4 + 8));
+        __m128i r3 = _mm_loadu_si128((const __m128i*)(acc + t * 4 + 12));
+        __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+        __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+        __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+        __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+        __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1)),
+                                    _mm_add_epi32(_mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)));
+        _mm_storeu_si128((__m128i*)(out + t),
+                         _mm_add_epi32(_mm_loadu_si128((const __m128i*)(out + t)), sum));
+    }
+    for(; t < n; ++t) {
+        out[t] = mix_add(out[t], mix_add(mix_add(acc[t * 4], acc[t * 4 + 1]),
+                                         mix_add(acc[t * 4 + 2], acc[t * 4 + 3])));
+    }
+}
+
+SSE2_FUNCTION static void mix_voice_bank_sse2(voice_bank* bank, int32_t* out, int32_t n, int interpolate) {
+    int32_t acc[MIX_CHUNK_SIZE * 4];
+
+    while(n > 0) {
+        int32_t count = n < MIX_CHUNK_SIZE ? n : MIX_CHUNK_SIZE;
+
+        memset(acc, 0, count * 4 * sizeof(*acc));
+        for(int32_t lane = 0; lane < bank->num_voices; lane += 4) {
+            mix_group_sse2(bank, lane, acc, count, interpolate);
+        }
+        reduce_sse2(acc, out, count);
+
+        out += count;
+        n -= count;
+    }
+}
+
+AVX2_FUNCTION static inline __m256 avx2_sine(__m256i phase, int interpolate) {
+    __m256i index = _mm256_srli_epi32(phase, WAVETABLE_FRAC_BITS);
+    __m256 a = _mm256_i32gather_ps(sine_wavetable, index, 4);
+
+    if(interpolate) {
+        __m256 b = _mm256_i32gather_ps(sine_wavetable + 1, index, 4);
+        __m256i fraction = _mm256_and_si256(phase, _mm256_set1_epi32(WAVETABLE_FRAC_MASK));
+        __m256 frac = _mm256_mul_ps(_mm256_cvtepi32_ps(fraction), _mm256_set1_ps(1.0f / (1 << WAVETABLE_FRAC_BITS)));
+        a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), frac));
+    }
+    return a;
+}
+
+/* See sse2_envelope. */
+AVX2_FUNCTION static inline __m256i avx2_envelope(__m256i sample, __m256i env) {
+    const __m256d divisor = _mm256_set1_pd(envelope_size);
+    __m128i low = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sample)), divisor));
+    __m128i high = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sample, 1)), divisor));
+    __m256i quotient = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    __m256i scaled = _mm256_mullo_epi32(quotient, env);
+    return _mm256_blendv_epi8(scaled, sample, _mm256_cmpeq_epi32(env, _mm256_setzero_si256()));
+}
+
+/* Adds n samples of the eight voices starting at lane into acc, which holds
+   eight partial sums per sample. */
+AVX2_FUNCTION static void mix_group_avx2(voice_bank* bank, int32_t lane, int32_t* acc,
+                                         int32_t n, int interpolate) {
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i increment = _mm256_set1_epi32((int32_t)(UINT32_MAX / sample_rate));
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(INT32_MAX));
+    uint32_t types = group_types(bank, lane, 8);
+    int has_envelope = group_has_envelope(bank, lane, 8);
+    __m256i type = _mm256_loadu_si256((const __m256i*)(bank->type + lane));
+    __m256i gain = _mm256_loadu_si256((const __m256i*)(bank->gain + lane));
+    __m256 fgain = _mm256_loadu_ps(bank->fgain + lane);
+    __m256i phase = _mm256_loadu_si256((const __m256i*)(bank->phase + lane));
+    __m256i step = _mm256_loadu_si256((const __m256i*)(bank->step + lane));
+    __m256i frequency = _mm256_loadu_si256((const __m256i*)(bank->frequency + lane));
+    __m256i fm_phase = _mm256_loadu_si256((const __m256i*)(bank->fm_phase + lane));
+    __m256i fm_step = _mm256_loadu_si256((const __m256i*)(bank->fm_step + lane));
+    __m256 fm_gain = _mm256_loadu_ps(bank->fm_gain + lane);
+    __m256i env = _mm256_loadu_si256((const __m256i*)(bank->env + lane));
+    __m256i env_step = _mm256_loadu_si256((const __m256i*)(bank->env_step + lane));
+    __m256i is_square = _mm256_cmpeq_epi32(type, _mm256_set1_epi32(SQUARE));
+    __m256i is_saw = _mm256_cmpeq_epi32(type, _mm256_set1_epi32(SAWTOOTH));
+    __m256i is_triangle = _mm256_cmpeq_epi32(type, _mm256_set1_epi32(TRIANGLE));
+    __m256i is_sine = _mm256_or_si256(_mm256_cmpeq_epi32(type, _mm256_set1_epi32(SINE)),
+                                      _mm256_cmpeq_epi32(type, _mm256_set1_epi32(FM)));
+
+    for(int32_t t = 0; t < n; ++t) {
+        __m256i sample = _mm256_setzero_si256();
+        __m256i centred;
+
+        if(types & (1u << FM)) {
+            __m256i mod;
+            fm_phase = _mm256_add_epi32(fm_phase, fm_step);
+            mod = _mm256_cvtps_epi32(_mm256_mul_ps(avx2_sine(fm_phase, interpolate), fm_gain));
+            step = _mm256_mullo_epi32(increment, _mm256_add_epi32(mod, frequency));
+        }
+        phase = _mm256_add_epi32(phase, step);
+        centred = _mm256_xor_si256(phase, sign);
+
+        if(types & (1u << SQUARE)) {
+            __m256i high = _mm256_srai_epi32(phase, 31);
+            __m256i square = _mm256_blendv_epi8(_mm256_sub_epi32(_mm256_setzero_si256(), gain), gain, high);
+            sample = _mm256_blendv_epi8(sample, square, is_square);
+        }
+        if(types & (1u << SAWTOOTH)) {
+            __m256 value = _mm256_mul_ps(_mm256_cvtepi32_ps(centred), _mm256_set1_ps(0x1p-32f));
+            sample = _mm256_blendv_epi8(sample, _mm256_cvtps_epi32(_mm256_mul_ps(value, fgain)), is_saw);
+        }
+        if(types & (1u << TRIANGLE)) {
+            __m256 value = _mm256_and_ps(_mm256_cvtepi32_ps(centred), abs_mask);
+            value = _mm256_sub_ps(_mm256_mul_ps(value, _mm256_set1_ps(0x1p-30f)), _mm256_set1_ps(1.0f));
+            sample = _mm256_blendv_epi8(sample, _mm256_cvtps_epi32(_mm256_mul_ps(value, fgain)), is_triangle);
+        }
+        if(types & ((1u << SINE) | (1u << FM))) {
+            __m256 value = avx2_sine(phase, interpolate);
+            sample = _mm256_blendv_epi8(sample, _mm256_cvtps_epi32(_mm256_mul_ps(value, fgain)), is_sine);
+        }
+        if(has_envelope) {
+            sample = avx2_envelope(sample, env);
+            env = _mm256_add_epi32(env, env_step);
+        }
+
+        _mm256_storeu_si256((__m256i*)(acc + t * 8),
+                            _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(acc + t * 8)), sample));
+    }
+
+    _mm256_storeu_si256((__m256i*)(bank->phase + lane), phase);
+    _mm256_storeu_si256((__m256i*)(bank->fm_phase + lane), fm_phase);
+    _mm256_storeu_si256((__m256i*)(bank->env + lane), env);
+}
+
+/* out[t] += the eight partial sums for sample t, eight samples at a time.
+   Two rounds of hadd leave each 128 bit half holding four samples' sums over
+   half the lanes; adding the halves finishes the job. */
+AVX2_FUNCTION static void reduce_avx2(const int32_t* acc, int32_t* out, int32_t n) {
+    int32_t t = 0;
+
+    for(; t + 8 <= n; t += 8) {
+        const __m256i* rows = (const __m256i*)(acc + t * 8);
+        __m256i h01 = _mm256_hadd_epi32(_mm256_loadu_si256(rows), _mm256_loadu_si256(rows + 1));
+        __m256i h23 = _mm256_hadd_epi32(_mm256_loadu_si256(rows + 2), _mm256_loadu_si256(rows + 3));
+        __m256i h45 = _mm256_hadd_epi32(_mm256_loadu_si256(rows + 4), _mm256_loadu_si256(rows + 5));
+        __m256i h67 = _mm256_hadd_epi32(_mm256_loadu_si256(rows + 6), _mm256_loadu_si256(rows + 7));
+        __m256i h0123 = _mm256_hadd_epi32(h01, h23);
+        __m256i h4567 = _mm256_hadd_epi32(h45, h67);
+        __m256i sum = _mm256_add_epi32(_mm256_permute2x128_si256(h0123, h4567, 0x20),
+                                       _mm256_permute2x128_si256(h0123, h4567, 0x31));
+        _mm256_storeu_si256((__m256i*)(out + t),
+                            _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(out + t)), sum));
+    }
+    for(; t < n; ++t) {
+        int32_t sum = 0;
+        for(int32_t i = 0; i < 8; ++i) {
+            sum = mix_add(sum, acc[t * 8 + i]);
+        }
+        out[t] = mix_add(out[t], sum);
+    }
+}
+
+AVX2_FUNCTION static void mix_voice_bank_avx2(voice_bank* bank, int32_t* out, int32_t n, int interpolate) {
+    int32_t acc[MIX_CHUNK_SIZE * 8];
+
+    while(n > 0) {
+        int32_t count = n < MIX_CHUNK_SIZE ? n : MIX_CHUNK_SIZE;
+
+        memset(acc, 0, count * 8 * sizeof(*acc));
+        for(int32_t lane = 0; lane < bank->num_voices; lane += 8) {
+            mix_group_avx2(bank, lane, acc, count, interpolate);
+        }
+        reduce_avx2(acc, out, count);
+
+        out += count;
+        n -= count;
+    }
+}
+
+#endif
+
+static voice_kernel current_kernel = VOICE_KERNEL_AUTO;
+static voice_bank_mixer current_mixer = NULL;
+
+static int kernel_supported(voice_kernel kernel) {
+    switch(kernel) {
+    case VOICE_KERNEL_SCALAR:
+        return 1;
+#ifdef VOICE_BANK_X86
+    case VOICE_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case VOICE_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+voice_kernel select_voice_kernel(voice_kernel requested) {
+    voice_kernel kernel = requested == VOICE_KERNEL_AUTO ? VOICE_KERNEL_AVX2 : requested;
+
+#ifdef VOICE_BANK_X86
+    __builtin_cpu_init();
+#endif
+    while(!kernel_supported(kernel)) {
+        kernel = (voice_kernel)(kernel - 1);
+    }
+
+    switch(kernel) {
+#ifdef VOICE_BANK_X86
+    case VOICE_KERNEL_AVX2:
+        current_mixer = mix_voice_bank_avx2;
+        break;
+    case VOICE_KERNEL_SSE2:
+        current_mixer = mix_voice_bank_sse2;
+        break;
+#endif
+    default:
+        current_mixer = mix_voice_bank_scalar;
+        break;
+    }
+    current_kernel = kernel;
+    return kernel;
+}
+
+voice_kernel current_voice_kernel(void) {
+    if(current_mixer == NULL) {
+        select_voice_kernel(current_kernel);
+    }
+    return current_kernel;
+}
+
+const char* voice_kernel_name(voice_kernel kernel) {
+    switch(kernel) {
+    case VOICE_KERNEL_SCALAR:
+        return "scalar";
+    case VOICE_KERNEL_SSE2:
+        return "sse2";
+    case VOICE_KERNEL_AVX2:
+        return "avx2";
+    default:
+        return "auto";
+    }
+}
+
+void mix_voice_bank(voice_bank* bank, int32_t* out, int32_t n, int interpolate) {
+    current_voice_kernel();
+    current_mixer(bank, out, n, interpolate);
+}
@@ -0,0 +1,69 @@
+#ifndef VOICEBANK_H
+#define VOICEBANK_H
+
+#include <stdint.h>
+
+#include "tinysynth.h"
+
+/* Widest vector kernel, in voices. Banks are padded to a multiple of this
+   with silent voices so kernels never need a remainder loop. */
+#define VOICE_BANK_LANES 8
+
+typedef enum _voice_kernel {
+    VOICE_KERNEL_AUTO = 0, /* best the CPU supports */
+    VOICE_KERNEL_SCALAR = 1,
+    VOICE_KERNEL_SSE2 = 2, /* 4 voices per instruction */
+    VOICE_KERNEL_AVX2 = 3  /* 8 voices per instruction */
+} voice_kernel;
+
+/* The table engine's sounding voices in structure of arrays form, so the
+   vector kernels can step a whole group of voices at once. Lane i of every
+   array belongs to the same voice. */
+typedef struct _voice_bank {
+    int32_t num_voices; /* voices added since the bank was cleared */
+    int32_t capacity;   /* a multiple of VOICE_BANK_LANES */
+    int32_t* type;
+    int32_t* gain;
+    float* fgain;
+    uint32_t* phase;
+    uint32_t* step;     /* phase_increment(frequency) */
+    int32_t* frequency;
+    uint32_t* fm_phase;
+    uint32_t* fm_freq;  /* 0 for anything but FM */
+    uint32_t* fm_step;  /* phase_increment(fm_freq) */
+    float* fm_gain;     /* 0 for anything but FM */
+    int32_t* env;       /* envelope multiplier for the next sample, 0 for none */
+    int32_t* env_step;
+} voice_bank;
+
+voice_bank* create_voice_bank(int32_t max_voices);
+void free_voice_bank(voice_bank* bank);
+
+/* Empties the bank, leaving every lane silent. */
+void clear_voice_bank(voice_bank* bank);
+
+/* Copies a sounding oscillator into the next free lane and returns the lane,
+   with the envelope off. */
+int32_t add_voice(voice_bank* bank, const oscillator* osc, int32_t gain);
+
+/* Copies the phases of a lane back into the oscillator it came from. */
+void store_voice(const voice_bank* bank, int32_t lane, oscillator* osc);
+
+/* Adds the next n samples of every voice in the bank into out, applying and
+   advancing each lane's envelope. Output is bit identical to running each
+   voice through generate_table_osc_samples and mixing it as render_block
+   does, whichever kernel is in use. */
+void mix_voice_bank(voice_bank* bank, int32_t* out, int32_t n, int interpolate);
+
+/* Picks the kernel mix_voice_bank uses for the whole process. Asking for
+   something the CPU can't run falls back to the next best kernel. Returns
+   the kernel actually selected. */
+voice_kernel select_voice_kernel(voice_kernel requested);
+
+/* The kernel mix_voice_bank uses, selecting the best one if nothing has been
+   chosen yet. Call it before starting render threads so they never race to
+   make the choice. */
+voice_kernel current_voice_kernel(void);
+const char* voice_kernel_name(voice_kernel kernel);
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "wavetable.h"
+
+float sine_wavetable[WAVETABLE_SIZE + 1];
+
+static int wavetables_ready = 0;
+
+void init_wavetables(void) {
+    const double pi = 3.141592653589793238462643383279502;
+
+    if(wavetables_ready) {
+        return;
+    }
+
+    for(int i = 0; i < WAVETABLE_SIZE; ++i) {
+        sine_wavetable[i] = (float)sin(2 * pi * i / WAVETABLE_SIZE);
+    }
+    sine_wavetable[WAVETABLE_SIZE] = sine_wavetable[0];
+    wavetables_ready = 1;
+}
+
+int32_t generate_next_table_sample(oscillator* osc, int32_t gain, int interpolate) {
+    int32_t sample;
+    generate_table_osc_samples(osc, gain, &sample, 1, interpolate);
+    return sample;
+}
+
+void generate_table_osc_samples(oscillator* osc, int32_t gain, int32_t* out,
+                                int32_t n, int interpolate) {
+    uint32_t phase = osc->phase;
+    uint32_t step = phase_increment(osc->frequency);
+    float fgain = (float)gain;
+    int32_t i;
+
+    switch(osc->type) {
+    case SQUARE:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = phase > (UINT32_MAX / 2) ? gain : -gain;
+        }
+        break;
+
+    case SAWTOOTH:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = scale_sample((float)centred_phase(phase) * 0x1p-32f, fgain);
+        }
+        break;
+
+    case TRIANGLE:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = scale_sample(fabsf((float)centred_phase(phase)) * 0x1p-30f - 1.0f, fgain);
+        }
+        break;
+
+    case SINE:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = scale_sample(table_sine(phase, interpolate), fgain);
+        }
+        break;
+
+    case FM:
+    {
+        uint32_t fm_phase = osc->fm_phase;
+        uint32_t fm_step = phase_increment(osc->fm_freq);
+        float fm_gain = (float)osc->fm_gain;
+
+        for(i = 0; i < n; ++i) {
+            fm_phase += fm_step;
+            phase += phase_increment(scale_sample(table_sine(fm_phase, interpolate), fm_gain) + osc->frequency);
+            out[i] = scale_sample(table_sine(phase, interpolate), fgain);
+        }
+        osc->fm_phase = fm_phase;
+    }
+    break;
+
+    default:
+        for(i = 0; i < n; ++i) {
+            phase += step;
+            out[i] = 0;
+        }
+        break;
+    };
+
+    osc->phase = phase;
+}
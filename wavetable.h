@@ -0,0 +1,76 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+#include <stdint.h>
+#include <math.h>
+
+#include "tinysynth.h"
+
+/* The table engine looks sines up in a single cycle table indexed by the top
+   WAVETABLE_BITS of the 32 bit phase accumulator. The rest of the phase is
+   the fraction used for linear interpolation. */
+#define WAVETABLE_BITS 12
+#define WAVETABLE_SIZE (1 << WAVETABLE_BITS)
+#define WAVETABLE_FRAC_BITS (32 - WAVETABLE_BITS)
+#define WAVETABLE_FRAC_MASK ((1u << WAVETABLE_FRAC_BITS) - 1)
+
+/* One cycle of sine, plus a guard point equal to the first entry so
+   interpolation never has to wrap. */
+extern float sine_wavetable[WAVETABLE_SIZE + 1];
+
+/* Fills in the tables. Safe to call more than once; create_output_state
+   does so for every output state using the table engine. */
+void init_wavetables(void);
+
+/* The arithmetic below is shared with the vector kernels in voicebank.c,
+   which must perform exactly the same float operations in the same order to
+   stay bit identical to this scalar path. */
+
+static inline uint32_t phase_increment(int32_t frequency) {
+    return (UINT32_MAX / sample_rate) * frequency;
+}
+
+/* The phase as a signed offset from half a cycle, ie. phase - 2^31. Saw and
+   triangle are both simple functions of this, and it converts to float
+   without needing an unsigned conversion. */
+static inline int32_t centred_phase(uint32_t phase) {
+    return (int32_t)(phase ^ 0x80000000u);
+}
+
+static inline float table_sine(uint32_t phase, int interpolate) {
+    uint32_t index = phase >> WAVETABLE_FRAC_BITS;
+    float a = sine_wavetable[index];
+
+    if(interpolate) {
+        float frac = (float)(int32_t)(phase & WAVETABLE_FRAC_MASK) * (1.0f / (1 << WAVETABLE_FRAC_BITS));
+        return a + (sine_wavetable[index + 1] - a) * frac;
+    }
+    return a;
+}
+
+static inline int32_t scale_sample(float value, float gain) {
+    return (int32_t)lrintf(value * gain);
+}
+
+/* Drop in replacement for generate_next_osc_sample. Square is exact. Saw and
+   triangle are worked out straight from the phase in single precision, and
+   sine and FM come from sine_wavetable. Against the libm engine, for any
+   gain in gaintable, output differs by at most:
+     square                      0
+     saw                         2^-23 of |gain| + 1
+     triangle                    2^-22 of |gain| + 1
+     sine, interpolated          2^-20 of |gain| + 1
+     sine, nearest entry         2^-9 of |gain| + 1 (2 pi / WAVETABLE_SIZE)
+   The libm triangle overflows at a phase of exactly 0xffffffff and returns
+   -3 * gain there; the table engine doesn't reproduce that.
+   FM carriers stay within the sine bounds per sample, but the modulator's
+   rounding accumulates in the carrier phase, so FM output drifts from the
+   libm engine over a long note and isn't bounded sample for sample. */
+int32_t generate_next_table_sample(oscillator* osc, int32_t gain, int interpolate);
+
+/* Generates n consecutive samples of one oscillator into out, bit identical
+   to n calls of generate_next_table_sample. */
+void generate_table_osc_samples(oscillator* osc, int32_t gain, int32_t* out,
+                                int32_t n, int interpolate);
+
+#endif